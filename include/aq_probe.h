@@ -0,0 +1,84 @@
+#ifndef __AQ_PROBE_H__
+#define __AQ_PROBE_H__
+
+/*****************************************************************************
+ * Static tracepoints (USDT/SDT probes) for the queue and the stack.
+ *
+ * When <sys/sdt.h> is available (systemtap-sdt-dev, or systemtap-sdt-devel)
+ * each probe compiles to a single nop and a note in the ELF file saying
+ * where it is.  Nothing happens at run time until a tracer attaches, at
+ * which point it patches the nop into a breakpoint.  So the probes can stay
+ * in production builds, and be used on a live process with, for example:
+ *
+ *     bpftrace -e 'usdt:./prog:atomic_q:enqueue { @depth = hist(arg2); }'
+ *     perf probe -x ./prog sdt_atomic_q:dequeue
+ *
+ * The probes are:
+ *
+ *     atomic_q:enqueue        (queue, first element, aq_queued())
+ *     atomic_q:dequeue        (queue, element, aq_queued())
+ *     atomic_q:dequeue_empty  (queue, NULL, aq_queued())
+ *     atomic_q:dequeue_retry  (queue, head element, aq_queued())
+ *     atomic_q:el_free        (queue, element, aq_queued())
+ *                             fired just before the freeer is called, or
+ *                             the element is retired to its domain
+ *     atomic_stack:push       (stack, entry)
+ *     atomic_stack:push_list  (stack, first entry, last entry)
+ *     atomic_stack:pop        (stack, entry, or NULL if empty)
+ *
+ * Each probe has a semaphore, a counter in the .probes section that
+ * tracers raise while they are attached (see _SDT_HAS_SEMAPHORES in
+ * <sys/sdt.h>.)  The probe and its arguments are behind a test of it, so
+ * with no tracer a probe costs one load of a read-mostly counter and an
+ * untaken branch.  In particular aq_queued(), which loads the head and
+ * tail, is only evaluated while somebody is listening.
+ *
+ * Without <sys/sdt.h>, or with -DAQ_NO_PROBES, the probes expand to
+ * nothing.
+ ****************************************************************************/
+
+#if !defined(AQ_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define AQ_HAVE_PROBES
+#endif
+#endif
+
+#ifdef AQ_HAVE_PROBES
+
+/* The semaphore of probe provider:name, non-zero while it is traced */
+#define AQ_PROBE_SEMAPHORE(provider, name)				\
+	static volatile unsigned short provider##_##name##_semaphore	\
+	__attribute__((used, section(".probes")))
+
+AQ_PROBE_SEMAPHORE(atomic_q, enqueue);
+AQ_PROBE_SEMAPHORE(atomic_q, dequeue);
+AQ_PROBE_SEMAPHORE(atomic_q, dequeue_empty);
+AQ_PROBE_SEMAPHORE(atomic_q, dequeue_retry);
+AQ_PROBE_SEMAPHORE(atomic_q, el_free);
+AQ_PROBE_SEMAPHORE(atomic_stack, push);
+AQ_PROBE_SEMAPHORE(atomic_stack, push_list);
+AQ_PROBE_SEMAPHORE(atomic_stack, pop);
+
+#define AQ_PROBE_ENABLED(provider, name)				\
+	__builtin_expect(provider##_##name##_semaphore != 0, 0)
+
+#define AQ_PROBE2(provider, name, a1, a2) do {				\
+	if (AQ_PROBE_ENABLED(provider, name))				\
+		DTRACE_PROBE2(provider, name, a1, a2);			\
+} while (0)
+#define AQ_PROBE3(provider, name, a1, a2, a3) do {			\
+	if (AQ_PROBE_ENABLED(provider, name))				\
+		DTRACE_PROBE3(provider, name, a1, a2, a3);		\
+} while (0)
+
+#else
+
+#define AQ_PROBE_ENABLED(provider, name) (0)
+#define AQ_PROBE2(provider, name, a1, a2) do { } while (0)
+#define AQ_PROBE3(provider, name, a1, a2, a3) do { } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,213 @@
+#ifndef __AQ_SLAB_H__
+#define __AQ_SLAB_H__
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "atomic_q.h"
+#include "atomic_stack.h"
+#include "util.h"
+
+/*****************************************************************************
+ * A type-stable slab allocator for objects with an embedded struct
+ * atomic_el.
+ *
+ * atomic_q.h may READ elements after handing them to the freeer, so
+ * elements must stay mapped and keep their layout after being freed.  This
+ * allocator carves fixed size, 16 byte aligned objects out of large arenas
+ * and never gives an arena back until <aq_slab_destroy>, so it satisfies
+ * that without every user writing a pool of their own.  Free objects are
+ * kept on a struct as_head freelist.
+ *
+ * <aq_slab_freeer> can be passed straight to <aq_init> as the freeer, with
+ * the slab as freeer_arg.  The freelist link lives outside the
+ * struct atomic_el, which the queue may still be reading.
+ *
+ * An example:
+ *
+ * struct my_msg {
+ *      struct atomic_el el;
+ *      uint64_t something;
+ * } *msg;
+ *
+ * aq_slab_init(&slab, sizeof(struct my_msg),
+ *              offsetof(struct my_msg, el), 4096);
+ * aq_init(&q, aq_slab_alloc_el(&slab), aq_slab_freeer, &slab);
+ *   ...
+ * msg = aq_slab_alloc(&slab);
+ * aq_enqueue(&q, &msg->el);
+ *   ...
+ * aq_el_free(&q, el);          (eventually calls aq_slab_freeer)
+ ****************************************************************************/
+
+/* Header of each arena.  The objects follow it. */
+struct aq_slab_arena {
+	struct aq_slab_arena *next;
+	char _pad[56];
+};
+
+struct aq_slab {
+	struct as_head free;
+	char _pad1[64 - sizeof(struct as_head)];
+	size_t obj_size;	/* bytes per object, a multiple of 16 */
+	size_t el_offset;	/* where the struct atomic_el is */
+	size_t link_offset;	/* where the freelist link is */
+	size_t arena_objs;	/* objects per arena */
+	uint64_t nobjs;		/* objects carved so far */
+	struct aq_slab_arena *arenas;
+	int grow_lock;
+};
+
+/*
+ * Initialize a slab of objects of obj_size bytes, with a struct atomic_el
+ * el_offset bytes in (16 byte aligned.)  Arenas hold arena_objs objects.
+ * No memory is allocated until the first <aq_slab_alloc>.
+ */
+static inline void aq_slab_init(struct aq_slab *slab,
+				size_t obj_size,
+				size_t el_offset,
+				size_t arena_objs)
+{
+	assert(((unsigned long)slab & 0x0F) == 0);
+	assert((el_offset & 0x0F) == 0);
+	assert(el_offset + sizeof(struct atomic_el) <= obj_size);
+	assert(arena_objs > 0);
+
+	/* Keep the freelist link clear of the queue's struct atomic_el */
+	if (el_offset >= sizeof(struct as_entry))
+		slab->link_offset = 0;
+	else
+		slab->link_offset = el_offset + sizeof(struct atomic_el);
+	if (obj_size < slab->link_offset + sizeof(struct as_entry))
+		obj_size = slab->link_offset + sizeof(struct as_entry);
+
+	as_init(&slab->free);
+	slab->obj_size = (obj_size + 0x0F) & ~(size_t)0x0F;
+	slab->el_offset = el_offset;
+	slab->arena_objs = arena_objs;
+	slab->nobjs = 0;
+	slab->arenas = NULL;
+	slab->grow_lock = 0;
+}
+
+/* The embedded element of an object, and back */
+static inline struct atomic_el *aq_slab_el(struct aq_slab *slab, void *obj)
+{
+	return (struct atomic_el *)((char *)obj + slab->el_offset);
+}
+
+static inline void *aq_slab_obj(struct aq_slab *slab, struct atomic_el *el)
+{
+	return (char *)el - slab->el_offset;
+}
+
+/* Put an object on the freelist */
+static inline void aq_slab_free(struct aq_slab *slab, void *obj)
+{
+	as_push(&slab->free, (struct as_entry *)((char *)obj + slab->link_offset));
+}
+
+/*
+ * Add an arena to the slab.  Returns false if we are out of memory.  If
+ * another thread is already growing the slab, just wait for it.
+ */
+static inline bool aq_slab_grow(struct aq_slab *slab)
+{
+	struct aq_slab_arena *arena;
+	struct as_entry *first, *e = NULL;
+	char *obj;
+	size_t i;
+
+	if (__sync_lock_test_and_set(&slab->grow_lock, 1)) {
+		while (__atomic_load_n(&slab->grow_lock, __ATOMIC_ACQUIRE))
+			cpu_relax();
+		return true;
+	}
+
+	/* Somebody may have freed objects, or grown, while we got here */
+	if (!as_empty(&slab->free)) {
+		__sync_lock_release(&slab->grow_lock);
+		return true;
+	}
+
+	if (posix_memalign((void **)&arena, 64,
+			   sizeof(*arena) + slab->arena_objs * slab->obj_size)) {
+		__sync_lock_release(&slab->grow_lock);
+		return false;
+	}
+
+	/* Link the new objects up privately and hand them over at once */
+	obj = (char *)(arena + 1);
+	first = (struct as_entry *)(obj + slab->link_offset);
+	for (i = 0; i < slab->arena_objs; i++, obj += slab->obj_size) {
+		e = (struct as_entry *)(obj + slab->link_offset);
+		e->next = (struct as_entry *)(obj + slab->obj_size +
+					      slab->link_offset);
+	}
+	as_push_list(&slab->free, first, e);
+
+	arena->next = slab->arenas;
+	slab->arenas = arena;
+	__sync_fetch_and_add(&slab->nobjs, slab->arena_objs);
+
+	__sync_lock_release(&slab->grow_lock);
+	return true;
+}
+
+/*
+ * Allocate an object, with its struct atomic_el ready to enqueue.
+ * Returns NULL if we are out of memory.
+ */
+static inline void *aq_slab_alloc(struct aq_slab *slab)
+{
+	struct as_entry *e;
+	void *obj;
+
+	while ((e = as_pop(&slab->free)) == NULL) {
+		if (!aq_slab_grow(slab))
+			return NULL;
+	}
+
+	obj = (char *)e - slab->link_offset;
+	aq_el_init(aq_slab_el(slab, obj));
+	return obj;
+}
+
+/* Allocate an object and return its struct atomic_el */
+static inline struct atomic_el *aq_slab_alloc_el(struct aq_slab *slab)
+{
+	void *obj = aq_slab_alloc(slab);
+
+	return obj ? aq_slab_el(slab, obj) : NULL;
+}
+
+/*
+ * The freeer to pass to <aq_init>, with the slab as the freeer_arg.
+ */
+static inline void aq_slab_freeer(void *arg, struct atomic_el *el)
+{
+	struct aq_slab *slab = (struct aq_slab *)arg;
+
+	aq_slab_free(slab, aq_slab_obj(slab, el));
+}
+
+/*
+ * Release all memory.  Every object is gone afterwards, allocated or not,
+ * and no queue may still be reading any of them.
+ */
+static inline void aq_slab_destroy(struct aq_slab *slab)
+{
+	struct aq_slab_arena *arena, *next;
+
+	for (arena = slab->arenas; arena != NULL; arena = next) {
+		next = arena->next;
+		free(arena);
+	}
+	as_init(&slab->free);
+	slab->arenas = NULL;
+	slab->nobjs = 0;
+}
+
+#endif
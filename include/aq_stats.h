@@ -0,0 +1,156 @@
+#ifndef __AQ_STATS_H__
+#define __AQ_STATS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*****************************************************************************
+ * Optional hot path counters for struct atomic_q.
+ *
+ * Build with -DAQ_STATS to have every queue count what its enqueuers and
+ * dequeuers do: calls, compare and swap attempts and failures at each call
+ * site, helping advances of a lagging tail, empty dequeues and the
+ * aq_el_free() calls that actually free an element.  Without AQ_STATS the
+ * counting macros expand to nothing and struct atomic_q carries no
+ * counters, so there is no cost at all.
+ *
+ * A counter every thread bumped would become the most contended cache
+ * line in the queue, so each queue keeps AQ_STATS_SHARDS copies, each on
+ * its own cache lines.  Threads are spread over the shards round robin
+ * the first time they count anything.  With more threads than shards two
+ * threads can share one, so the increments are still atomic, but a shard
+ * is normally only ever touched by one core.
+ *
+ * Read the counters with <aq_get_stats> (atomic_q.h), which adds up the
+ * shards, and zero them with <aq_reset_stats>.  Both are only approximate
+ * while other threads are using the queue.  Compare and swap retries per
+ * element are (AQ_STAT_*_FAIL + AQ_STAT_*_RETRY) over AQ_STAT_ENQUEUE or
+ * AQ_STAT_DEQUEUE.
+ ****************************************************************************/
+
+enum aq_stat {
+	AQ_STAT_ENQUEUE,	/* elements enqueued */
+	AQ_STAT_ENQ_RETRY,	/* tail moved before we could use it */
+	AQ_STAT_ENQ_LINK,	/* link CAS on the last element's next */
+	AQ_STAT_ENQ_LINK_FAIL,
+	AQ_STAT_ENQ_HELP,	/* advance of a lagging tail by an enqueuer */
+	AQ_STAT_ENQ_HELP_FAIL,
+	AQ_STAT_ENQ_SWING,	/* final CAS of the tail to our last element */
+	AQ_STAT_ENQ_SWING_FAIL,
+	AQ_STAT_DEQUEUE,	/* elements dequeued */
+	AQ_STAT_DEQ_EMPTY,	/* dequeue calls that found nothing */
+	AQ_STAT_DEQ_RETRY,	/* head moved before we could use it */
+	AQ_STAT_DEQ_HEAD,	/* CAS of the head past what we took */
+	AQ_STAT_DEQ_HEAD_FAIL,
+	AQ_STAT_DEQ_HELP,	/* advance of a lagging tail by a dequeuer */
+	AQ_STAT_DEQ_HELP_FAIL,
+	AQ_STAT_EL_FREE,	/* aq_el_free() calls that freed the element */
+	AQ_STAT_NR
+};
+
+static const char *const aq_stat_names[AQ_STAT_NR] = {
+	[AQ_STAT_ENQUEUE]	= "enqueue",
+	[AQ_STAT_ENQ_RETRY]	= "enq_retry",
+	[AQ_STAT_ENQ_LINK]	= "enq_link",
+	[AQ_STAT_ENQ_LINK_FAIL]	= "enq_link_fail",
+	[AQ_STAT_ENQ_HELP]	= "enq_help",
+	[AQ_STAT_ENQ_HELP_FAIL]	= "enq_help_fail",
+	[AQ_STAT_ENQ_SWING]	= "enq_swing",
+	[AQ_STAT_ENQ_SWING_FAIL] = "enq_swing_fail",
+	[AQ_STAT_DEQUEUE]	= "dequeue",
+	[AQ_STAT_DEQ_EMPTY]	= "deq_empty",
+	[AQ_STAT_DEQ_RETRY]	= "deq_retry",
+	[AQ_STAT_DEQ_HEAD]	= "deq_head",
+	[AQ_STAT_DEQ_HEAD_FAIL]	= "deq_head_fail",
+	[AQ_STAT_DEQ_HELP]	= "deq_help",
+	[AQ_STAT_DEQ_HELP_FAIL]	= "deq_help_fail",
+	[AQ_STAT_EL_FREE]	= "el_free",
+};
+
+/* A consistent-ish copy of a queue's counters */
+struct aq_stats_snapshot {
+	uint64_t count[AQ_STAT_NR];
+};
+
+#ifdef AQ_STATS
+
+#ifndef AQ_STATS_SHARDS
+#define AQ_STATS_SHARDS (16)
+#endif
+
+struct aq_stats_shard {
+	uint64_t count[AQ_STAT_NR];
+} __attribute__((aligned(64)));
+
+struct aq_stats {
+	struct aq_stats_shard shard[AQ_STATS_SHARDS];
+};
+
+/* The calling thread's shard, or -1 before it has counted anything */
+static __thread int aq_stats_self = -1;
+
+static inline int aq_stats_shard_id(void)
+{
+	static unsigned int next;
+
+	if (__builtin_expect(aq_stats_self < 0, 0))
+		aq_stats_self = __sync_fetch_and_add(&next, 1) %
+				AQ_STATS_SHARDS;
+	return aq_stats_self;
+}
+
+static inline void aq_stats_add(struct aq_stats *st, enum aq_stat stat,
+				uint64_t n)
+{
+	__atomic_fetch_add(&st->shard[aq_stats_shard_id()].count[stat], n,
+			   __ATOMIC_RELAXED);
+}
+
+static inline void aq_stats_sum(const struct aq_stats *st,
+				struct aq_stats_snapshot *snap)
+{
+	int i, j;
+
+	memset(snap, 0, sizeof(*snap));
+	for (i = 0; i < AQ_STATS_SHARDS; i++)
+		for (j = 0; j < AQ_STAT_NR; j++)
+			snap->count[j] += __atomic_load_n(
+				&st->shard[i].count[j], __ATOMIC_RELAXED);
+}
+
+static inline void aq_stats_clear(struct aq_stats *st)
+{
+	int i, j;
+
+	for (i = 0; i < AQ_STATS_SHARDS; i++)
+		for (j = 0; j < AQ_STAT_NR; j++)
+			__atomic_store_n(&st->shard[i].count[j], 0,
+					 __ATOMIC_RELAXED);
+}
+
+/* Count n events of kind stat on queue mb (or 1 for AQ_STAT_INC) */
+#define AQ_STAT_ADD(mb, stat, n) aq_stats_add(&(mb)->stats, (stat), (n))
+
+/*
+ * Evaluate the compare and swap cas, counting it as an attempt at site
+ * stat, and as a failure at stat_FAIL if it fails.  Evaluates to the
+ * result of cas.
+ */
+#define AQ_STAT_CAS(mb, stat, cas) ({				\
+	bool __ok = (cas);					\
+	AQ_STAT_INC(mb, stat);					\
+	if (!__ok)						\
+		AQ_STAT_INC(mb, stat##_FAIL);			\
+	__ok; })
+
+#else
+
+#define AQ_STAT_ADD(mb, stat, n) do { } while (0)
+#define AQ_STAT_CAS(mb, stat, cas) (cas)
+
+#endif
+
+#define AQ_STAT_INC(mb, stat) AQ_STAT_ADD(mb, stat, 1)
+
+#endif
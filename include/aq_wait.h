@@ -0,0 +1,182 @@
+#ifndef __AQ_WAIT_H__
+#define __AQ_WAIT_H__
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "futex.h"
+#include "util.h"
+
+/*****************************************************************************
+ * Adaptive spin-then-park waiting.
+ *
+ * Going straight from a failed poll to a system call costs wake-up latency,
+ * spinning forever costs a core.  An aq_waiter walks through three stages
+ * while the condition it waits for is false:
+ *
+ *     1. spin with cpu_relax() (PAUSE) for spin_limit iterations
+ *     2. sched_yield() for yield_limit iterations
+ *     3. park, i.e. sleep until somebody wakes us or a timeout expires
+ *
+ * In AQ_WAIT_ADAPTIVE mode the spin and yield limits are recalibrated
+ * after every wait from a moving average of how long waits actually took.
+ * When events arrive quickly the average is small and we spin just long
+ * enough to catch them; when they arrive slowly spinning would not have
+ * helped anyway, so the limits collapse and we park almost immediately.
+ *
+ * Usage:
+ *
+ * struct aq_waiter w;
+ *
+ * aq_waiter_init(&w, AQ_WAIT_ADAPTIVE);
+ *   ...
+ * while (!condition) {
+ *         if (aq_wait_spin(&w))
+ *                 aq_wait_park(&w);     (or a queue specific park)
+ * }
+ * aq_wait_done(&w);
+ *
+ * An aq_waiter holds per-thread calibration state and must not be shared
+ * between threads.
+ ****************************************************************************/
+
+enum aq_wait_mode {
+	AQ_WAIT_ADAPTIVE,	/* calibrated spin, then yield, then park */
+	AQ_WAIT_SPIN,		/* only ever spin */
+	AQ_WAIT_YIELD,		/* only ever sched_yield() */
+	AQ_WAIT_PARK,		/* park right away */
+};
+
+/* Bounds for the calibrated spin limit (in PAUSE iterations) */
+#define AQ_WAIT_MIN_SPIN   (16)
+#define AQ_WAIT_MAX_SPIN   (8192)
+/* Number of sched_yield() calls before parking when waits are short */
+#define AQ_WAIT_YIELDS     (8)
+/* Bounds for the sleep of <aq_wait_park> (in nanoseconds) */
+#define AQ_WAIT_MIN_PARK   (1000L)
+#define AQ_WAIT_MAX_PARK   (1000000L)
+
+struct aq_waiter {
+	enum aq_wait_mode mode;
+	uint32_t spin_limit;	/* spins before we start yielding */
+	uint32_t yield_limit;	/* yields before we park */
+	uint32_t iter;		/* spins + yields in the current wait */
+	uint32_t parks;		/* parks in the current wait */
+	uint32_t park_word;	/* futex word for <aq_wait_park> */
+	int64_t avg;		/* moving average of iter per wait, << 4 */
+};
+
+/*
+ * Recompute the limits from the moving average.  We spin for twice the
+ * typical wait, so most waits end in the spin stage, as long as that is
+ * cheaper than a trip through the scheduler.
+ */
+static inline void aq_waiter_calibrate(struct aq_waiter *w)
+{
+	int64_t typical = w->avg >> 4;
+
+	if (w->mode != AQ_WAIT_ADAPTIVE)
+		return;
+
+	if (typical * 2 <= AQ_WAIT_MAX_SPIN) {
+		w->spin_limit = typical * 2;
+		if (w->spin_limit < AQ_WAIT_MIN_SPIN)
+			w->spin_limit = AQ_WAIT_MIN_SPIN;
+		w->yield_limit = AQ_WAIT_YIELDS;
+	} else {
+		/* Waits are long, spinning is just burning CPU */
+		w->spin_limit = AQ_WAIT_MIN_SPIN;
+		w->yield_limit = 1;
+	}
+}
+
+/* Initialize a waiter in the given mode. */
+static inline void aq_waiter_init(struct aq_waiter *w, enum aq_wait_mode mode)
+{
+	w->mode = mode;
+	w->iter = 0;
+	w->parks = 0;
+	w->park_word = 0;
+	w->avg = (int64_t)AQ_WAIT_MAX_SPIN << 3;
+
+	switch (mode) {
+	case AQ_WAIT_SPIN:
+		w->spin_limit = UINT32_MAX;
+		w->yield_limit = 0;
+		break;
+	case AQ_WAIT_YIELD:
+		w->spin_limit = 0;
+		w->yield_limit = UINT32_MAX;
+		break;
+	case AQ_WAIT_PARK:
+		w->spin_limit = 0;
+		w->yield_limit = 0;
+		break;
+	default:
+		aq_waiter_calibrate(w);
+		break;
+	}
+}
+
+/*
+ * Do one step of spinning or yielding.  Returns true once both stages are
+ * exhausted and the caller should park.
+ */
+static inline bool aq_wait_spin(struct aq_waiter *w)
+{
+	if (w->iter < w->spin_limit) {
+		w->iter++;
+		cpu_relax();
+		return false;
+	}
+	if (w->iter - w->spin_limit < w->yield_limit) {
+		w->iter++;
+		sched_yield();
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Generic park for conditions that nobody signals (e.g. a producer
+ * waiting for queue capacity.)  Sleeps for an interval that doubles with
+ * every park in the same wait, between AQ_WAIT_MIN_PARK and
+ * AQ_WAIT_MAX_PARK.
+ */
+static inline void aq_wait_park(struct aq_waiter *w)
+{
+	struct timespec ts = { 0, AQ_WAIT_MIN_PARK };
+	uint32_t shift = w->parks < 10 ? w->parks : 10;
+
+	ts.tv_nsec <<= shift;
+	if (ts.tv_nsec > AQ_WAIT_MAX_PARK)
+		ts.tv_nsec = AQ_WAIT_MAX_PARK;
+
+	w->parks++;
+	futex_wait(&w->park_word, w->park_word, &ts);
+}
+
+/*
+ * Called when the wait is over, the condition became true.  Feeds the
+ * length of this wait into the calibration and resets for the next one.
+ */
+static inline void aq_wait_done(struct aq_waiter *w)
+{
+	int64_t sample = w->iter;
+
+	/* A wait that had to park counts as a long one */
+	if (w->parks)
+		sample = 2 * AQ_WAIT_MAX_SPIN;
+
+	/* Waits that never started tell us little, but they do tell us
+	 * things are arriving fast. */
+	w->avg += ((sample << 4) - w->avg) >> 3;
+	aq_waiter_calibrate(w);
+
+	w->iter = 0;
+	w->parks = 0;
+}
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef __AS_ELIM_H__
+#define __AS_ELIM_H__
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "atomic_stack.h"
+#include "ccas.h"
+#include "util.h"
+
+/*****************************************************************************
+ * An elimination-backoff stack, as described in "A Scalable Lock-free
+ * Stack Algorithm" by Danny Hendler, Nir Shavit and Lena Yerushalmi
+ * (SPAA 2004.)
+ *
+ * Under contention every as_push() and as_pop() keeps retrying its
+ * compare and swap on the one shared s->first.  Here a thread that loses
+ * that race backs off into an elimination array instead of straight back
+ * to the head.  A push and a pop that meet in the array cancel out: the
+ * popper takes the pusher's entry directly and neither touches the head.
+ * The more threads there are, the more likely they meet, so traffic on
+ * the head grows much more slowly than the thread count.
+ *
+ * The exchange is asymmetric.  A pusher offers its entry in a random slot
+ * and spins for a while; a popper that finds an offer in a slot takes it.
+ * If nobody comes the pusher withdraws the offer and goes back to the
+ * head.  Slots are counted pointers, so an entry that is taken, pushed
+ * again and re-offered in the same slot can't be withdrawn by mistake.
+ *
+ * Each thread keeps a small amount of state (a random seed and how many
+ * slots it currently spreads over) in thread local storage.  The range
+ * shrinks when offers time out and grows when slots are busy, as in the
+ * paper.
+ *
+ * An example:
+ *
+ * struct as_elim_stack s;
+ *
+ * as_elim_init(&s);
+ *   ...
+ * as_elim_push(&s, &msg->ase);
+ *   ...
+ * rcv = as_elim_pop(&s);
+ *
+ * Entries have the same lifetime rules as as_pop(): the popper may read an
+ * entry that somebody else already popped.  Entries taken by elimination
+ * are never read at all.
+ ****************************************************************************/
+
+/* Slots in the elimination array */
+#ifndef AS_ELIM_SLOTS
+#define AS_ELIM_SLOTS (16)
+#endif
+
+/* How long a pusher waits for a popper before withdrawing its offer */
+#ifndef AS_ELIM_SPINS
+#define AS_ELIM_SPINS (128)
+#endif
+
+/* One slot per cache line */
+struct as_elim_slot {
+	struct counted_ptr offer;
+	char _pad[64 - sizeof(struct counted_ptr)];
+};
+
+struct as_elim_stack {
+	struct as_head head;
+	char _pad[64 - sizeof(struct as_head)];
+	struct as_elim_slot slots[AS_ELIM_SLOTS];
+};
+
+/* Per-thread elimination state */
+struct as_elim_thread {
+	uint32_t seed;
+	int range;
+};
+
+static __thread struct as_elim_thread as_elim_self;
+
+/* Initialize the stack.  It must be COUNTED_ALIGN byte aligned. */
+static inline void as_elim_init(struct as_elim_stack *s)
+{
+	int i;
+
+	as_init(&s->head);
+	for (i = 0; i < AS_ELIM_SLOTS; i++)
+		counted_set(&s->slots[i].offer, NULL, 0, false);
+}
+
+/* Pick a slot in the calling thread's current range */
+static inline struct as_elim_slot *as_elim_slot(struct as_elim_stack *s)
+{
+	struct as_elim_thread *t = &as_elim_self;
+	uint32_t x = t->seed;
+
+	if (x == 0) {
+		/* First use by this thread */
+		x = (uint32_t)(uintptr_t)t | 1;
+		t->range = 1;
+	}
+
+	/* xorshift32 */
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	t->seed = x;
+
+	return &s->slots[x % t->range];
+}
+
+/* Spread over more slots, or fewer */
+static inline void as_elim_grow(void)
+{
+	if (as_elim_self.range < AS_ELIM_SLOTS)
+		as_elim_self.range++;
+}
+
+static inline void as_elim_shrink(void)
+{
+	if (as_elim_self.range > 1)
+		as_elim_self.range--;
+}
+
+/*
+ * Offer e in the elimination array.  Returns true if a popper took it.
+ */
+static inline bool as_elim_offer(struct as_elim_stack *s, struct as_entry *e)
+{
+	struct as_elim_slot *slot = as_elim_slot(s);
+	struct counted_ptr old = counted_load_relaxed(&slot->offer), mine;
+	int i;
+
+	if (counted_get_ptr(old) != NULL ||
+	    !counted_compare_and_swap_release(&slot->offer, old, e, 1)) {
+		/* Somebody else is using it */
+		as_elim_grow();
+		return false;
+	}
+	mine = counted_make(e, counted_get_ctr(old) + 1, false);
+
+	for (i = 0; i < AS_ELIM_SPINS; i++) {
+		if (!counted_ptr_eq(counted_read_relaxed(&slot->offer), mine)) {
+			/* Only a popper changes our offer */
+			return true;
+		}
+		cpu_relax();
+	}
+
+	if (counted_compare_and_swap_relaxed(&slot->offer, mine, NULL, 1)) {
+		as_elim_shrink();
+		return false;
+	}
+
+	/* Taken just as we gave up */
+	return true;
+}
+
+/*
+ * Look for an offer in the elimination array.  Returns the entry, or NULL
+ * if there was none.
+ */
+static inline struct as_entry *as_elim_take(struct as_elim_stack *s)
+{
+	struct as_elim_slot *slot = as_elim_slot(s);
+	struct counted_ptr old = counted_load(&slot->offer);
+
+	if (counted_get_ptr(old) == NULL) {
+		as_elim_shrink();
+		return NULL;
+	}
+	if (!counted_compare_and_swap_acquire(&slot->offer, old, NULL, 1)) {
+		as_elim_grow();
+		return NULL;
+	}
+	return counted_get_ptr(old);
+}
+
+/* Push an entry on the stack */
+static inline void as_elim_push(struct as_elim_stack *s, struct as_entry *e)
+{
+	while (!as_try_push(&s->head, e)) {
+		if (as_elim_offer(s, e))
+			return;
+	}
+}
+
+/* Pop an entry from the stack.  Returns NULL if the stack is empty. */
+static inline struct as_entry *as_elim_pop(struct as_elim_stack *s)
+{
+	struct as_entry *e;
+
+	while (!as_try_pop(&s->head, &e)) {
+		e = as_elim_take(s);
+		if (e != NULL)
+			break;
+	}
+	return e;
+}
+
+/*
+ * Return true if the stack is empty.  Entries on offer in the elimination
+ * array are on their way in, and don't count.
+ */
+static inline bool as_elim_empty(struct as_elim_stack *s)
+{
+	return as_empty(&s->head);
+}
+
+#endif
@@ -0,0 +1,325 @@
+#ifndef __AS_MAGAZINE_H__
+#define __AS_MAGAZINE_H__
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "atomic_stack.h"
+
+/*****************************************************************************
+ * Per-thread magazine caches in front of a struct as_head freelist, as
+ * described in "Magazines and Vmem: Extending the Slab Allocator to Many
+ * CPUs and Arbitrary Resources" by Jeff Bonwick and Jonathan Adams
+ * (USENIX 2001.)
+ *
+ * Using an as_head directly as a freelist means every allocation and free
+ * is a compare and swap on the one shared s->first.  Instead each thread
+ * keeps a struct as_mag_cache holding two magazines, small arrays of up to
+ * AS_MAG_ROUNDS objects, and allocates from and frees to them with no
+ * atomic operations at all.  Only when both are empty (allocating) or both
+ * are full (freeing) does the thread go to the shared struct as_depot and
+ * swap a whole magazine for a full or an empty one.  That is about one
+ * shared operation per AS_MAG_ROUNDS calls.
+ *
+ * The depot sits on top of the original freelist (the backing stack),
+ * which supplies objects when there are no full magazines and takes them
+ * back when a cache goes away.  It too is only touched once per magazine:
+ * a thread that runs dry takes the whole freelist with one as_pop_all(),
+ * loads a magazine from it, and hands the rest to the depot as full
+ * magazines for the next threads that run dry.
+ *
+ * An example:
+ *
+ * as_depot_init(&depot, &freelist);
+ *   ...in each thread
+ * struct as_mag_cache cache;
+ * as_mag_cache_init(&cache, &depot);
+ * e = as_mag_alloc(&cache);
+ *   ...
+ * as_mag_free(&cache, e);
+ *   ...
+ * as_mag_cache_release(&cache);
+ *
+ * Magazines themselves are malloc()ed and only freed by as_depot_destroy(),
+ * since as_pop() may read a magazine after another thread popped it.
+ ****************************************************************************/
+
+/* Objects per magazine */
+#ifndef AS_MAG_ROUNDS
+#define AS_MAG_ROUNDS (32)
+#endif
+
+/* Times to wait out other threads' refills before finding nothing */
+#ifndef AS_MAG_RELOAD_TRIES
+#define AS_MAG_RELOAD_TRIES (4)
+#endif
+
+struct as_magazine {
+	struct as_entry link;	/* on the depot's full or empty stack */
+	int rounds;		/* objects in objs[] */
+	struct as_entry *objs[AS_MAG_ROUNDS];
+};
+
+/* The shared depot.  Each stack is on its own cache line. */
+struct as_depot {
+	struct as_head full;
+	char _pad1[64 - sizeof(struct as_head)];
+	struct as_head empty;
+	char _pad2[64 - sizeof(struct as_head)];
+	struct as_head *backing;
+	/* Refills of a cache from the backing freelist, begun and ended */
+	unsigned long refills_begun;
+	unsigned long refills_done;
+};
+
+/* A thread's cache.  Never shared between threads. */
+struct as_mag_cache {
+	struct as_depot *depot;
+	struct as_magazine *loaded;
+	struct as_magazine *previous;
+};
+
+/* Initialize a depot in front of the freelist backing. */
+static inline void as_depot_init(struct as_depot *d, struct as_head *backing)
+{
+	as_init(&d->full);
+	as_init(&d->empty);
+	d->backing = backing;
+	d->refills_begun = d->refills_done = 0;
+}
+
+static inline struct as_magazine *as_mag_from_entry(struct as_entry *e)
+{
+	return e ? container_of(e, struct as_magazine, link) : NULL;
+}
+
+/* Get an empty magazine from the depot, or make one */
+static inline struct as_magazine *as_depot_get_empty(struct as_depot *d)
+{
+	struct as_magazine *m = as_mag_from_entry(as_pop(&d->empty));
+
+	if (m == NULL) {
+		m = malloc(sizeof(*m));
+		if (m != NULL)
+			m->rounds = 0;
+	}
+	return m;
+}
+
+/* Return every object in m to the backing freelist, in one go */
+static inline void as_depot_flush(struct as_depot *d, struct as_magazine *m)
+{
+	int i;
+
+	if (m->rounds == 0)
+		return;
+	for (i = 0; i < m->rounds - 1; i++)
+		m->objs[i]->next = m->objs[i + 1];
+	as_push_list(d->backing, m->objs[0], m->objs[m->rounds - 1]);
+	m->rounds = 0;
+}
+
+/*
+ * Set up a thread's cache.  Returns false if the magazines could not be
+ * allocated.
+ */
+static inline bool as_mag_cache_init(struct as_mag_cache *c,
+				     struct as_depot *d)
+{
+	c->depot = d;
+	c->loaded = as_depot_get_empty(d);
+	c->previous = as_depot_get_empty(d);
+	if (c->loaded == NULL || c->previous == NULL) {
+		/* Not freed, another thread's as_pop() may still read it */
+		if (c->loaded != NULL)
+			as_push(&d->empty, &c->loaded->link);
+		if (c->previous != NULL)
+			as_push(&d->empty, &c->previous->link);
+		c->loaded = c->previous = NULL;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Tear down a thread's cache.  Full magazines go to the depot, partial
+ * ones are emptied back to the backing freelist.
+ */
+static inline void as_mag_cache_release(struct as_mag_cache *c)
+{
+	struct as_magazine *mags[2] = { c->loaded, c->previous };
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (mags[i]->rounds == AS_MAG_ROUNDS) {
+			as_push(&c->depot->full, &mags[i]->link);
+		} else {
+			as_depot_flush(c->depot, mags[i]);
+			as_push(&c->depot->empty, &mags[i]->link);
+		}
+	}
+	c->loaded = c->previous = NULL;
+}
+
+static inline void as_mag_swap(struct as_mag_cache *c)
+{
+	struct as_magazine *m = c->loaded;
+
+	c->loaded = c->previous;
+	c->previous = m;
+}
+
+/*
+ * Load the (empty) loaded magazine from the backing freelist.  Takes the
+ * whole freelist at once, keeps the first AS_MAG_ROUNDS objects, and puts
+ * the rest in full magazines on the depot.  A partial last magazine's
+ * worth goes back to the freelist.  Returns false if the freelist was
+ * empty.
+ *
+ * While that goes on the objects are in neither place, so the refill
+ * is counted in the depot for <as_mag_alloc> to see.
+ */
+static inline bool as_mag_refill(struct as_mag_cache *c)
+{
+	struct as_depot *d = c->depot;
+	struct as_magazine *m = c->loaded;
+	struct as_entry *e, *last;
+
+	__atomic_fetch_add(&d->refills_begun, 1, __ATOMIC_SEQ_CST);
+	e = as_pop_all(d->backing);
+	while (e != NULL) {
+		while (e != NULL && m->rounds < AS_MAG_ROUNDS) {
+			m->objs[m->rounds++] = e;
+			e = e->next;
+		}
+		if (m != c->loaded) {
+			if (m->rounds < AS_MAG_ROUNDS) {
+				as_depot_flush(d, m);
+				as_push(&d->empty, &m->link);
+			} else {
+				as_push(&d->full, &m->link);
+			}
+		}
+		if (e == NULL)
+			break;
+		m = as_depot_get_empty(d);
+		if (m == NULL) {
+			/* No memory for magazines, give the rest back */
+			for (last = e; last->next != NULL; last = last->next)
+				;
+			as_push_list(d->backing, e, last);
+			break;
+		}
+	}
+	__atomic_fetch_add(&d->refills_done, 1, __ATOMIC_RELEASE);
+	return c->loaded->rounds != 0;
+}
+
+/*
+ * Both magazines are empty.  Trade one for a full magazine from the depot,
+ * or failing that load one from the freelist itself.  Returns false if
+ * there are no objects anywhere.
+ *
+ * Objects another thread is refilling from are on neither the freelist
+ * nor the depot.  So if another refill was in flight when we looked, or
+ * began while ours did, wait for it to finish and look again, up to
+ * AS_MAG_RELOAD_TRIES times.  The retries are bounded because every
+ * thread that comes here empty handed starts a refill of its own, so
+ * threads starved together would otherwise keep each other looking.
+ */
+static inline bool as_mag_reload(struct as_mag_cache *c)
+{
+	struct as_depot *d = c->depot;
+	struct as_magazine *m;
+	unsigned long begun;
+	bool busy;
+	int tries;
+
+	for (tries = 0;; tries++) {
+		begun = __atomic_load_n(&d->refills_begun, __ATOMIC_SEQ_CST);
+		busy = __atomic_load_n(&d->refills_done, __ATOMIC_ACQUIRE) !=
+		       begun;
+		m = as_mag_from_entry(as_pop(&d->full));
+		if (m != NULL) {
+			as_push(&d->empty, &c->previous->link);
+			c->previous = m;
+			as_mag_swap(c);
+			return true;
+		}
+		if (as_mag_refill(c))
+			return true;
+		/* Ours is the only refill since we looked, so it is all gone */
+		if (!busy && __atomic_load_n(&d->refills_begun,
+					     __ATOMIC_SEQ_CST) == begun + 1)
+			return false;
+		if (tries == AS_MAG_RELOAD_TRIES)
+			return false;
+		/* Wait until as many refills are done as had begun */
+		while ((long)(__atomic_load_n(&d->refills_done,
+					      __ATOMIC_ACQUIRE) -
+			      (begun + 1)) < 0)
+			cpu_relax();
+	}
+}
+
+/* Allocate an object, or return NULL if there are none left. */
+static inline struct as_entry *as_mag_alloc(struct as_mag_cache *c)
+{
+	if (c->loaded->rounds == 0) {
+		if (c->previous->rounds != 0)
+			as_mag_swap(c);
+		else if (!as_mag_reload(c))
+			return NULL;
+	}
+
+	return c->loaded->objs[--c->loaded->rounds];
+}
+
+/* Free an object. */
+static inline void as_mag_free(struct as_mag_cache *c, struct as_entry *e)
+{
+	struct as_magazine *m;
+
+	if (c->loaded->rounds == AS_MAG_ROUNDS) {
+		if (c->previous->rounds == AS_MAG_ROUNDS) {
+			/* Both full.  Trade one for an empty magazine from
+			 * the depot, or failing that go to the freelist
+			 * itself
+			 */
+			m = as_depot_get_empty(c->depot);
+			if (m == NULL) {
+				as_push(c->depot->backing, e);
+				return;
+			}
+			as_push(&c->depot->full, &c->previous->link);
+			c->previous = m;
+		}
+		as_mag_swap(c);
+	}
+
+	c->loaded->objs[c->loaded->rounds++] = e;
+}
+
+/*
+ * Return everything in the depot to the backing freelist and free the
+ * magazines.  Every thread must have released its cache.
+ */
+static inline void as_depot_destroy(struct as_depot *d)
+{
+	struct as_entry *e, *next;
+	struct as_magazine *m;
+
+	for (e = as_pop_all(&d->full); e != NULL; e = next) {
+		next = e->next;
+		m = as_mag_from_entry(e);
+		as_depot_flush(d, m);
+		free(m);
+	}
+	for (e = as_pop_all(&d->empty); e != NULL; e = next) {
+		next = e->next;
+		free(as_mag_from_entry(e));
+	}
+}
+
+#endif
@@ -1,10 +1,19 @@
 #ifndef __ATOMIC_Q_H__
 #define __ATOMIC_Q_H__
 #include <assert.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <time.h>
 
+#include "aq_probe.h"
+#include "aq_stats.h"
+#include "aq_wait.h"
+#include "backoff.h"
 #include "ccas.h"
+#include "epoch.h"
+#include "futex.h"
+#include "hazard.h"
 
 /*****************************************************************************
  * author: Dave Boutcher <daveboutcher@gmail.com>    
@@ -49,6 +58,18 @@
  *
  * Because of the above, never call the freer you passed into
  * <aq_ini>t directly, instead call <aq_el_free>
+ *
+ * If elements really need to be returned to the system, initialize the
+ * queue with <aq_init_hp> instead.  The queue then protects every element
+ * it reads with a hazard pointer (see hazard.h), and the freeer is only
+ * called once no thread can touch the element any more.  Each thread
+ * passes its struct hp_thread to the _hp variants of the calls below.
+ *
+ * Hazard pointers cost a store and a fence for every element read.  A
+ * queue initialized with <aq_init_ebr> instead uses epoch based or
+ * quiescent state based reclamation (see epoch.h), whichever the domain
+ * was set up for, through the _ebr variants of the calls.  Freed elements
+ * are then handed to the freeer in batches.
  ****************************************************************************/
 
 /*****************************************************************************
@@ -57,14 +78,22 @@
 
 /* The atomic_q structure is the root of each queue.  aq_init()
  * should be called before it is used, and aq_free() when it is done.
- * It needs to be 16 byte aligned.
+ * It needs to be COUNTED_ALIGN (16, or 8 with CCAS_TAGGED) byte aligned.
  */
 struct atomic_q;
 
-/* The field within a element being enqueued.  It needs to be 16 byte aligned.
+/* The field within a element being enqueued.  It needs to be COUNTED_ALIGN
+ * byte aligned.
  */
 struct atomic_el;
 
+/*
+ * Link el to next when building a chain of elements for
+ * <aq_enqueue_multi>.  The last element in the chain links to NULL.
+ */
+static inline void
+aq_el_chain(struct atomic_el *el, struct atomic_el *next);
+
 /*
  * Initialize a queue.  The dummyel is an initial dummy element for
  * the queue that will be freed when the first element is dequeued.  The
@@ -72,7 +101,7 @@ struct atomic_el;
  * become the "dummy" element at the head of the queue, this will be AFTER the
  * dequeue function returns the element.
  *
- * Elements MUST be 16 byte aligned
+ * Elements MUST be COUNTED_ALIGN byte aligned
  *
  */
 static inline void
@@ -82,10 +111,46 @@ aq_init(struct atomic_q *mb,
 	void *freeer_arg);
 
 
+/*
+ * Initialize a queue in hazard pointer mode.  Elements are reclaimed
+ * through the domain dom, and the queue must only be used through
+ * <aq_enqueue_hp>, <aq_enqueue_multi_hp>, <aq_dequeue_hp>,
+ * <aq_empty_hp> and <aq_el_free_hp>.
+ */
+static inline void
+aq_init_hp(struct atomic_q *mb,
+	   struct atomic_el *dummyel,
+	   void (*freeer)(void *arg, struct atomic_el *),
+	   void *freeer_arg,
+	   struct hp_domain *dom);
+
+/*
+ * Initialize a queue in epoch (EBR or QSBR) mode.  Elements are reclaimed
+ * through the domain dom, and the queue must only be used through
+ * <aq_enqueue_ebr>, <aq_enqueue_multi_ebr>, <aq_dequeue_ebr>,
+ * <aq_empty_ebr> and <aq_el_free_ebr>.
+ */
+static inline void
+aq_init_ebr(struct atomic_q *mb,
+	    struct atomic_el *dummyel,
+	    void (*freeer)(void *arg, struct atomic_el *),
+	    void *freeer_arg,
+	    struct ebr_domain *dom);
+
+/*
+ * Choose what enqueuers and dequeuers do after losing a compare and swap
+ * on the queue (see backoff.h.)  Queues start out with BACKOFF_DEFAULT.
+ * Call it before the queue is shared.
+ */
+static inline void
+aq_set_backoff(struct atomic_q *mb, enum backoff_mode mode);
+
 /*
  * Free a queue.  Note that no producers/consumers should
  * still be active when this is called (bad things will happen)
- * It frees all elements currently on the queue.
+ * It frees all elements currently on the queue.  In hazard pointer and
+ * epoch mode it also drains the domain, so no thread may be using anything
+ * else in the domain either.
  */
 static inline void
 aq_free(struct atomic_q *mb);
@@ -96,15 +161,69 @@ aq_free(struct atomic_q *mb);
 static inline long
 aq_enqueue(struct atomic_q *mb, struct atomic_el *payload);
 
+/*
+ * Dequeue a element.  Returns NULL immediately if the queue is empty.
+ */
+static inline struct atomic_el *
+aq_dequeue(struct atomic_q *mb);
+
+/*
+ * Hazard pointer versions of the calls above, for queues set up with
+ * <aq_init_hp>.  ht is the calling thread's record in the queue's domain.
+ * They also work on ordinary queues if ht is NULL.
+ */
+static inline long
+aq_enqueue_hp(struct atomic_q *mb, struct atomic_el *el, struct hp_thread *ht);
+
+static inline struct atomic_el *
+aq_dequeue_hp(struct atomic_q *mb, struct hp_thread *ht);
+
+/*
+ * Epoch versions of the calls above, for queues set up with
+ * <aq_init_ebr>.  et is the calling thread's record in the queue's domain.
+ */
+static inline long
+aq_enqueue_ebr(struct atomic_q *mb, struct atomic_el *el, struct ebr_thread *et);
+
+static inline struct atomic_el *
+aq_dequeue_ebr(struct atomic_q *mb, struct ebr_thread *et);
+
+/*
+ * Dequeue up to max elements with a single CAS on the head, storing them
+ * in order in out[].  Returns the number dequeued, 0 if the queue is
+ * empty.  Each returned element must be released with <aq_el_free> as
+ * usual.  Not available in hazard pointer or epoch mode.
+ */
+static inline int
+aq_dequeue_multi(struct atomic_q *mb, int max, struct atomic_el **out);
+
+/* Block policies for <aq_dequeue_wait> */
+#define AQ_NONBLOCK ((const struct timespec *)0)
+#define AQ_BLOCK    ((const struct timespec *)1)
+
 /*
  * Dequeue a element.  If the queue is empty, and block_policy is AQ_BLOCK
  * then the call will block. If the block_policy is AQ_NONBLOCK then NULL
  * will be returned. Otherwise, block_policy is a pointer to the maximum
- * amount of time to sleep--after which NULL is returned in no element
+ * amount of time to sleep--after which NULL is returned if no element
  * has arrived.
+ *
+ * Sleeping consumers are parked on a futex and woken by <aq_enqueue>.
+ * Enqueuers only make a system call when somebody is actually asleep.
+ * Not available in hazard pointer or epoch mode.
  */
 static inline struct atomic_el *
-aq_dequeue(struct atomic_q *mb);
+aq_dequeue_wait(struct atomic_q *mb, const struct timespec *block_policy);
+
+/*
+ * Like <aq_dequeue_wait>, but before sleeping on the futex spin and yield
+ * as directed by the waiter w (see aq_wait.h.)  w carries the per-thread
+ * calibration state, so each consumer thread should use its own.
+ */
+static inline struct atomic_el *
+aq_dequeue_spinwait(struct atomic_q *mb,
+		    const struct timespec *block_policy,
+		    struct aq_waiter *w);
 
 /*
  * Check if a queue is empty
@@ -112,6 +231,12 @@ aq_dequeue(struct atomic_q *mb);
 static inline bool
 aq_empty(const struct atomic_q * const mb);
 
+static inline bool
+aq_empty_hp(const struct atomic_q * const mb, struct hp_thread *ht);
+
+static inline bool
+aq_empty_ebr(const struct atomic_q * const mb, struct ebr_thread *et);
+
 /*
  * Return number of elements in the queue.  This is an upper bound (there
  * may in fact be less than this number of elements in the queue, depending
@@ -121,6 +246,17 @@ static inline long
 aq_queued(const struct atomic_q * const mb);
 
 
+/*
+ * Copy the queue's counters (see aq_stats.h) to snap.  Without AQ_STATS
+ * they are all zero.
+ */
+static inline void
+aq_get_stats(const struct atomic_q * const mb, struct aq_stats_snapshot *snap);
+
+/* Zero the queue's counters */
+static inline void
+aq_reset_stats(struct atomic_q *mb);
+
 /*
  * Initialized the reference management information for the element.
  * This should only be called once for each element
@@ -135,6 +271,12 @@ aq_el_init(struct atomic_el *el);
 static inline void
 aq_el_free(struct atomic_q *mb, struct atomic_el *el);
 
+static inline void
+aq_el_free_hp(struct atomic_q *mb, struct atomic_el *el, struct hp_thread *ht);
+
+static inline void
+aq_el_free_ebr(struct atomic_q *mb, struct atomic_el *el, struct ebr_thread *et);
+
 
 /*****************************************************************************
  ************************** INTERNAL INTERFACES ******************************
@@ -146,8 +288,8 @@ aq_el_free(struct atomic_q *mb, struct atomic_el *el);
  *****************************************************************************/
 
 /*
- * The atomic element.  Users must not touch the first 16 bytes of the
- * element, even after it is dequeued.  It is in use until the "freeer"
+ * The atomic element.  Users must not touch it, even after the element
+ * is dequeued.  It is in use until the "freeer"
  * function is called.
  */
 struct atomic_el {
@@ -163,18 +305,27 @@ struct atomic_el {
 struct atomic_q {
 	void (*freeer)(void *, struct atomic_el *);
 	void *freeer_arg;
-	char _pad1[48];
+	struct hp_domain *hp;	/* NULL unless aq_init_hp() */
+	struct ebr_domain *ebr;	/* NULL unless aq_init_ebr() */
+	enum backoff_mode backoff;
+	char _pad1[32 - sizeof(enum backoff_mode)];
 	struct counted_ptr head;
-	char _pad2[48];
+	char _pad2[64 - sizeof(struct counted_ptr)];
 	struct counted_ptr tail;
-	char _pad3[48];
+	char _pad3[64 - sizeof(struct counted_ptr)];
+	uint32_t waiters;	/* consumers asleep in aq_dequeue_wait() */
+	uint32_t wake_seq;	/* futex word, bumped for every wakeup */
+	char _pad4[56];
+#ifdef AQ_STATS
+	struct aq_stats stats;
+#endif
 };
 
 /* Convert a counted pointer to an atomic element */
 static inline struct atomic_el
 *aq_from_cp(const struct counted_ptr *cp)
 {
-	return (struct atomic_el *)cp->ptr;
+	return (struct atomic_el *)counted_get_ptr(*cp);
 }
 
 /*
@@ -186,37 +337,141 @@ aq_init(struct atomic_q *mb,
 	void (*freeer)(void *, struct atomic_el *),
 	void *freeer_arg)
 {
-	/* The cmpxchg16b instruction requires 16 byte aligned memory */
-	assert(((unsigned long)mb & 0x0F) == 0);
-	assert(((unsigned long)dummyel & 0x0F) == 0);
+	/* The cmpxchg instructions require aligned memory */
+	assert(((unsigned long)mb & (COUNTED_ALIGN - 1)) == 0);
+	assert(((unsigned long)dummyel & (COUNTED_ALIGN - 1)) == 0);
 
-	/* Allocate and set up the dummy node in the queue */
-	dummyel->next.ptr = NULL;
-	/* the dummy never is never returned from dequeue, so preset the
+	/* Allocate and set up the dummy node in the queue.
+	   the dummy never is never returned from dequeue, so preset the
 	   "refcount" to only need a single toggle */
-	dummyel->next.ctr = 1L<<63;
+	counted_set(&dummyel->next, NULL, 0, true);
 
-	mb->head.ptr = dummyel;
-	mb->tail.ptr = dummyel;
-	mb->head.ctr = 0;
-	mb->tail.ctr = 0;
+	counted_set(&mb->head, dummyel, 0, false);
+	counted_set(&mb->tail, dummyel, 0, false);
+
+	mb->waiters = 0;
+	mb->wake_seq = 0;
 
 	mb->freeer = freeer;
 	mb->freeer_arg = freeer_arg;
+	mb->hp = NULL;
+	mb->ebr = NULL;
+	mb->backoff = BACKOFF_DEFAULT;
+	aq_reset_stats(mb);
+}
+
+static inline void
+aq_set_backoff(struct atomic_q *mb, enum backoff_mode mode)
+{
+	mb->backoff = mode;
+}
+
+static inline void
+aq_get_stats(const struct atomic_q * const mb, struct aq_stats_snapshot *snap)
+{
+#ifdef AQ_STATS
+	aq_stats_sum(&mb->stats, snap);
+#else
+	(void)mb;
+	memset(snap, 0, sizeof(*snap));
+#endif
+}
+
+static inline void
+aq_reset_stats(struct atomic_q *mb)
+{
+#ifdef AQ_STATS
+	aq_stats_clear(&mb->stats);
+#else
+	(void)mb;
+#endif
+}
+
+static inline void
+aq_init_hp(struct atomic_q *mb,
+	   struct atomic_el *dummyel,
+	   void (*freeer)(void *, struct atomic_el *),
+	   void *freeer_arg,
+	   struct hp_domain *dom)
+{
+	aq_init(mb, dummyel, freeer, freeer_arg);
+	mb->hp = dom;
+}
+
+static inline void
+aq_init_ebr(struct atomic_q *mb,
+	    struct atomic_el *dummyel,
+	    void (*freeer)(void *, struct atomic_el *),
+	    void *freeer_arg,
+	    struct ebr_domain *dom)
+{
+	aq_init(mb, dummyel, freeer, freeer_arg);
+	mb->ebr = dom;
+}
+
+/*
+ * Check that the calling thread passed the kind of thread record the
+ * queue's reclamation mode needs.
+ */
+static inline bool
+aq_rcl_ok(const struct atomic_q *mb,
+	  const struct hp_thread *ht,
+	  const struct ebr_thread *et)
+{
+	return ((ht == NULL) == (mb->hp == NULL) &&
+		(et == NULL) == (mb->ebr == NULL));
 }
 
 
 static inline void
 aq_el_init(struct atomic_el *el)
 {
-	el->next.ctr = 0;
+	counted_set(&el->next, NULL, 0, false);
+}
+
+static inline void
+aq_el_chain(struct atomic_el *el, struct atomic_el *next)
+{
+	counted_set_ptr(&el->next, next);
 }
 
 /* Return true if the queue is empty */
 static inline bool
 aq_empty(const struct atomic_q * const mb)
 {
-	return (aq_from_cp(&mb->head)->next.ptr == NULL);
+	struct atomic_el *head;
+
+	assert(mb->hp == NULL && mb->ebr == NULL);
+	head = counted_load_ptr(&mb->head);
+	return (counted_load_ptr(&head->next) == NULL);
+}
+
+static inline bool
+aq_empty_hp(const struct atomic_q * const mb, struct hp_thread *ht)
+{
+	struct counted_ptr head;
+	bool empty;
+
+	if (ht == NULL)
+		return aq_empty(mb);
+
+	head = hp_protect(ht, 0, &mb->head);
+	empty = (counted_load_ptr(&aq_from_cp(&head)->next) == NULL);
+	hp_clear(ht, 0);
+	return empty;
+}
+
+static inline bool
+aq_empty_ebr(const struct atomic_q * const mb, struct ebr_thread *et)
+{
+	struct atomic_el *head;
+	bool empty;
+
+	ebr_enter(et);
+	head = counted_load_ptr(&mb->head);
+	empty = (counted_load_ptr(&head->next) == NULL);
+	ebr_exit(et);
+	return empty;
 }
 
 /* Number of elements on the queue */
@@ -224,7 +479,8 @@ static inline long
 aq_queued(const struct atomic_q * const mb)
 {
 	/* Return the number of enqueues - number of dequeues */
-	return mb->tail.ctr - mb->head.ctr;
+	return counted_ctr_diff(counted_read_relaxed(&mb->tail),
+				counted_read_relaxed(&mb->head));
 }
 
 static inline void
@@ -235,63 +491,163 @@ aq_free(struct atomic_q *mb)
 	while (el) {
 		if (counted_compare_and_swap(&mb->head,
 					     mb->head,
-					     el->next.ptr,
+					     counted_get_ptr(el->next),
 					     1))
 			mb->freeer(mb->freeer_arg, el);
 		el = aq_from_cp(&mb->head);
 	}
 
-	mb->head.ptr = mb->tail.ptr = NULL;
-	mb->head.ctr = mb->tail.ctr = 0;
+	/* The domain may still hold our retired elements */
+	if (mb->hp)
+		hp_domain_drain(mb->hp);
+	if (mb->ebr)
+		ebr_domain_drain(mb->ebr);
+
+	counted_set(&mb->head, NULL, 0, false);
+	counted_set(&mb->tail, NULL, 0, false);
 	mb->freeer = NULL;
+	mb->hp = NULL;
+	mb->ebr = NULL;
+}
 
+/*
+ * hazard.h/epoch.h callback that passes a retired element on to the
+ * freeer
+ */
+static inline void
+aq_rcl_freeer(void *arg, void *el)
+{
+	struct atomic_q *mb = (struct atomic_q *)arg;
+
+	mb->freeer(mb->freeer_arg, (struct atomic_el *)el);
+}
+
+/*
+ * The guts of <aq_el_free> for every reclamation mode.  At most one of
+ * ht and et is set, matching the mode of the queue.
+ */
+static inline void
+aq_el_free_rcl(struct atomic_q *mb,
+	       struct atomic_el *el,
+	       struct hp_thread *ht,
+	       struct ebr_thread *et)
+{
+	assert(aq_rcl_ok(mb, ht, et));
+
+	if (counted_toggle_flag(&el->next)) {
+		AQ_STAT_INC(mb, AQ_STAT_EL_FREE);
+		AQ_PROBE3(atomic_q, el_free, mb, el, aq_queued(mb));
+		if (ht)
+			hp_retire(ht, el, aq_rcl_freeer, mb);
+		else if (et)
+			ebr_retire(et, el, aq_rcl_freeer, mb);
+		else
+			mb->freeer(mb->freeer_arg, el);
+	}
 }
 
 static inline void
 aq_el_free(struct atomic_q *mb, struct atomic_el *el)
 {
-	uint64_t i = __sync_fetch_and_xor((uint64_t *)&el->next.ctr, 1UL<<63);
-	if ((i & 1UL<<63) != 0)
-		mb->freeer(mb->freeer_arg, el);
+	aq_el_free_rcl(mb, el, NULL, NULL);
+}
+
+static inline void
+aq_el_free_hp(struct atomic_q *mb, struct atomic_el *el, struct hp_thread *ht)
+{
+	aq_el_free_rcl(mb, el, ht, NULL);
+}
+
+static inline void
+aq_el_free_ebr(struct atomic_q *mb, struct atomic_el *el, struct ebr_thread *et)
+{
+	aq_el_free_rcl(mb, el, NULL, et);
+}
+
+/*
+ * Wake up to count consumers sleeping in <aq_dequeue_wait>.  This must be
+ * called after the locked instruction that published the new elements,
+ * so the load of waiters cannot be satisfied before the elements are
+ * visible (see the matching increment in <aq_dequeue_wait>.)
+ */
+static inline void
+aq_wake(struct atomic_q *mb, int64_t count)
+{
+	if (__builtin_expect(__atomic_load_n(&mb->waiters,
+					     __ATOMIC_SEQ_CST) == 0, 1))
+		return;
+
+	__sync_fetch_and_add(&mb->wake_seq, 1);
+	futex_wake(&mb->wake_seq, count > INT_MAX ? INT_MAX : (int)count);
+}
+
+/*
+ * Snapshot the head or tail, protecting the element it points at in
+ * hazard pointer mode.
+ */
+static inline struct counted_ptr
+aq_snapshot(const struct counted_ptr *cp, struct hp_thread *ht)
+{
+	return ht ? hp_protect(ht, 0, cp) : counted_load(cp);
 }
 
 /*
  * This is much like <aq_enqueue>, but it assumes that el is a NULL
- * terminated linked list.
+ * terminated linked list.  This is the version for every reclamation
+ * mode; at most one of ht and et is set.
  */
 static inline long
-aq_enqueue_multi(struct atomic_q *mb, struct atomic_el *el)
+aq_enqueue_multi_rcl(struct atomic_q *mb,
+		     struct atomic_el *el,
+		     struct hp_thread *ht,
+		     struct ebr_thread *et)
 {
 	struct counted_ptr tail, next;
 	struct atomic_el *last_el = el;
 	int64_t count = 1;
+	struct backoff b;
+	long queued;
 
-	/* Make sure the element is 16 byte aligned */
-	assert(0 == ((unsigned long)el & 0x0F));
-	assert(0 == (el->next.ctr & 1L<<63));
+	/* Make sure the element is aligned */
+	assert(0 == ((unsigned long)el & (COUNTED_ALIGN - 1)));
+	assert(!counted_get_flag(el->next));
 
 	/* Get the last element in the chain of elements we're adding */
-	while (last_el->next.ptr != NULL) {
-		assert((uint64_t)last_el != (uint64_t)last_el->next.ptr);
+	while (counted_get_ptr(last_el->next) != NULL) {
+		assert(last_el != counted_get_ptr(last_el->next));
 		count++;
-		last_el = last_el->next.ptr;
+		last_el = counted_get_ptr(last_el->next);
 	}
 
+	assert(aq_rcl_ok(mb, ht, et));
+
+	if (et)
+		ebr_enter(et);
+
+	backoff_init(&b, mb->backoff);
+
+	/* In hazard pointer mode, protect the tail element
+	 * before we read it
+	 */
+	tail = aq_snapshot(&mb->tail, ht);
 	for (;;) {
-		tail = mb->tail;
-		next = aq_from_cp(&tail)->next;
+		next = counted_load(&aq_from_cp(&tail)->next);
 		assert(aq_from_cp(&tail) != el);
 
 		/* Make sure the tail didn't just move.  If so, iterate.
 		 */
-		if (!counted_ptr_eq(tail,mb->tail))
+		if (!counted_ptr_eq(tail, counted_read_relaxed(&mb->tail))) {
+			AQ_STAT_INC(mb, AQ_STAT_ENQ_RETRY);
+			backoff_pause(&b);
+			tail = aq_snapshot(&mb->tail, ht);
 			continue;
+		}
 
 		/* If the next pointer is NULL, we are really
 		 * at the tail and just atomically add the new
 		 * element to the tail
 		 */
-		if (next.ptr == NULL) {
+		if (counted_get_ptr(next) == NULL) {
 			/* We set the last element counted pointer
 			 * counter value here. The pointer part is
 			 * already NULL.  This just helps with some
@@ -300,102 +656,436 @@ aq_enqueue_multi(struct atomic_q *mb, struct atomic_el *el)
 			 * Null pointer/zero counter are too likely
 			 * to occur at some later time
 			 */
-			last_el->next.ctr = tail.ctr;
+			counted_set_ctr(&last_el->next, counted_get_ctr(tail));
 
 			/* Atomically change the next pointer
 			 * from NULL to our element. If someone
 			 * else made a change in the meantime,
-			 * next will no longer be NULL.
+			 * next will no longer be NULL.  Release,
+			 * so our writes to the elements are seen
+			 * by whoever follows the link.
 			 */
-			if (counted_compare_and_swap(&aq_from_cp(&tail)->next,
-						     next,
-						     el,
-						     1)) {
+			if (AQ_STAT_CAS(mb, AQ_STAT_ENQ_LINK,
+					counted_compare_exchange_release(
+						&aq_from_cp(&tail)->next,
+						&next,
+						el,
+						1))) {
 				break;
 			}
-		} else {
-			/* the tail wasn't really pointing to
-			 * the tail...advance it
+
+			/* next is now whatever beat us to it.  If
+			 * that is only a change of counter or flag,
+			 * start over.
 			 */
-			counted_compare_and_swap(&mb->tail,
-						 tail,
-						 next.ptr,
-						 1);
+			backoff_pause(&b);
+			if (counted_get_ptr(next) == NULL)
+				continue;
 		}
+
+		/* the tail wasn't really pointing to
+		 * the tail...advance it.  If somebody else
+		 * already did, tail is now what they left, read
+		 * with acquire so we can follow it.  A hazard
+		 * pointer has to be set up again though.
+		 */
+		if (AQ_STAT_CAS(mb, AQ_STAT_ENQ_HELP,
+				counted_compare_exchange_acq_rel(
+					&mb->tail,
+					&tail,
+					counted_get_ptr(next),
+					1)) || ht)
+			tail = aq_snapshot(&mb->tail, ht);
 	}
+	backoff_done(&b);
+
+	if (ht)
+		hp_clear(ht, 0);
 
 	/* Move the tail pointer to the last element (if the
-	 * tail hasn't moved in the mean-time)
+	 * tail hasn't moved in the mean-time).  This one stays a full
+	 * barrier, succeed or fail, since <aq_wake> relies on it.
 	 */
-	counted_compare_and_swap(&mb->tail,
-				 tail,
-				 last_el,
-				 count);
+	(void)AQ_STAT_CAS(mb, AQ_STAT_ENQ_SWING,
+			  counted_compare_and_swap(&mb->tail,
+						   tail,
+						   last_el,
+						   count));
+	AQ_STAT_ADD(mb, AQ_STAT_ENQUEUE, count);
+
+	if (et)
+		ebr_exit(et);
+
+	aq_wake(mb, count);
 
 	/*
 	 * return number of elements on queue
 	 */
-	return mb->tail.ctr - mb->head.ctr;
+	queued = aq_queued(mb);
+	AQ_PROBE3(atomic_q, enqueue, mb, el, queued);
+	return queued;
+}
+
+static inline long
+aq_enqueue_multi(struct atomic_q *mb, struct atomic_el *el)
+{
+	return aq_enqueue_multi_rcl(mb, el, NULL, NULL);
+}
+
+static inline long
+aq_enqueue_multi_hp(struct atomic_q *mb,
+		    struct atomic_el *el,
+		    struct hp_thread *ht)
+{
+	return aq_enqueue_multi_rcl(mb, el, ht, NULL);
+}
+
+static inline long
+aq_enqueue_multi_ebr(struct atomic_q *mb,
+		     struct atomic_el *el,
+		     struct ebr_thread *et)
+{
+	return aq_enqueue_multi_rcl(mb, el, NULL, et);
 }
 
 static inline long
 aq_enqueue(struct atomic_q *mb, struct atomic_el *el)
 {
-	el->next.ptr = NULL;
+	counted_set_ptr(&el->next, NULL);
 	return aq_enqueue_multi(mb, el);
 }
 
+static inline long
+aq_enqueue_hp(struct atomic_q *mb, struct atomic_el *el, struct hp_thread *ht)
+{
+	counted_set_ptr(&el->next, NULL);
+	return aq_enqueue_multi_hp(mb, el, ht);
+}
+
+static inline long
+aq_enqueue_ebr(struct atomic_q *mb, struct atomic_el *el, struct ebr_thread *et)
+{
+	counted_set_ptr(&el->next, NULL);
+	return aq_enqueue_multi_ebr(mb, el, et);
+}
+
+/*
+ * The dequeue for every reclamation mode; at most one of ht and et is
+ * set.
+ */
 static inline struct atomic_el *
-aq_dequeue(struct atomic_q *mb)
+aq_dequeue_rcl(struct atomic_q *mb,
+	       struct hp_thread *ht,
+	       struct ebr_thread *et)
 {
 	struct counted_ptr head, tail, next;
+	struct backoff b;
+
+	assert(aq_rcl_ok(mb, ht, et));
 
+	if (et)
+		ebr_enter(et);
+
+	backoff_init(&b, mb->backoff);
+	head = aq_snapshot(&mb->head, ht);
 	for (;;) {
-		head = mb->head;
-		tail = mb->tail;
-		next = aq_from_cp(&head)->next;
+		tail = counted_load_relaxed(&mb->tail);
+		next = counted_load(&aq_from_cp(&head)->next);
 
-		/* If the head just moved under us, just iterate */
-		if (!counted_ptr_eq(head,mb->head))
+		/* If the head just moved under us, just iterate.  The
+		 * acquire load of next keeps this re-read after it.
+		 */
+		if (!counted_ptr_eq(head, counted_read_relaxed(&mb->head))) {
+			AQ_STAT_INC(mb, AQ_STAT_DEQ_RETRY);
+			AQ_PROBE3(atomic_q, dequeue_retry, mb,
+				  aq_from_cp(&head), aq_queued(mb));
+			backoff_pause(&b);
+			head = aq_snapshot(&mb->head, ht);
 			continue;
+		}
 
 		/* If head and tail point to the same entry, this MAY BE
 		 * an empty queue.
 		 */
-		if (!next.ptr || (head.ptr == tail.ptr)) {
+		if (!counted_get_ptr(next) ||
+		    (counted_get_ptr(head) == counted_get_ptr(tail))) {
 			/* If next is really NULL, nothing to return
 			 */
-			if (next.ptr == NULL) {
+			if (counted_get_ptr(next) == NULL) {
+				if (ht)
+					hp_clear(ht, 0);
+				if (et)
+					ebr_exit(et);
+				backoff_done(&b);
+				AQ_STAT_INC(mb, AQ_STAT_DEQ_EMPTY);
+				AQ_PROBE3(atomic_q, dequeue_empty, mb, NULL,
+					  aq_queued(mb));
 				return NULL;
 			}
 			/* In this case, tail wasn't really pointing
 			 * to the tail.  Advance it and iterate
 			 */
-			counted_compare_and_swap(&mb->tail,
-						 tail,
-						 next.ptr,
-						 1);
+			(void)AQ_STAT_CAS(mb, AQ_STAT_DEQ_HELP,
+					  counted_compare_and_swap_release(
+						  &mb->tail,
+						  tail,
+						  counted_get_ptr(next),
+						  1));
 		} else {
 			/* We're going to return next
 			 */
-			assert(next.ptr != NULL);
+			assert(counted_get_ptr(next) != NULL);
 
 			/* Try and advance the head.  if this works,
-			 * we're done
+			 * we're done.  We already have next from an
+			 * acquire load, so success only has to
+			 * release the new head to other dequeuers.
+			 * On failure head is the new head, and we
+			 * follow it, so that needs acquire.
 			 */
-			if (counted_compare_and_swap(&mb->head,
-						     head,
-						     next.ptr,
-						     1)) {
+			if (AQ_STAT_CAS(mb, AQ_STAT_DEQ_HEAD,
+					counted_compare_exchange_acq_rel(
+						&mb->head,
+						&head,
+						counted_get_ptr(next),
+						1))) {
 				break;
 			}
+			AQ_PROBE3(atomic_q, dequeue_retry, mb,
+				  aq_from_cp(&head), aq_queued(mb));
+			backoff_pause(&b);
+			if (ht)
+				head = hp_protect(ht, 0, &mb->head);
 		}
 	}
 
+	if (ht)
+		hp_clear(ht, 0);
+	if (et)
+		ebr_exit(et);
+	backoff_done(&b);
+	AQ_STAT_INC(mb, AQ_STAT_DEQUEUE);
+
 	/* Free the head pointer */
-	aq_el_free(mb, aq_from_cp(&head));
+	aq_el_free_rcl(mb, aq_from_cp(&head), ht, et);
 
+	AQ_PROBE3(atomic_q, dequeue, mb, aq_from_cp(&next), aq_queued(mb));
 	return aq_from_cp(&next);
 }
 
+static inline struct atomic_el *
+aq_dequeue(struct atomic_q *mb)
+{
+	return aq_dequeue_rcl(mb, NULL, NULL);
+}
+
+static inline struct atomic_el *
+aq_dequeue_hp(struct atomic_q *mb, struct hp_thread *ht)
+{
+	return aq_dequeue_rcl(mb, ht, NULL);
+}
+
+static inline struct atomic_el *
+aq_dequeue_ebr(struct atomic_q *mb, struct ebr_thread *et)
+{
+	return aq_dequeue_rcl(mb, NULL, et);
+}
+
+static inline int
+aq_dequeue_multi(struct atomic_q *mb, int max, struct atomic_el **out)
+{
+	struct counted_ptr head, tail, next;
+	struct atomic_el *el;
+	struct backoff b;
+	int n, i;
+
+	assert(max > 0);
+	assert(mb->hp == NULL && mb->ebr == NULL);
+
+	backoff_init(&b, mb->backoff);
+	head = counted_load(&mb->head);
+	for (;;) {
+		tail = counted_load_relaxed(&mb->tail);
+		next = counted_load(&aq_from_cp(&head)->next);
+
+		/* If the head just moved under us, just iterate */
+		if (!counted_ptr_eq(head, counted_read_relaxed(&mb->head))) {
+			AQ_STAT_INC(mb, AQ_STAT_DEQ_RETRY);
+			AQ_PROBE3(atomic_q, dequeue_retry, mb,
+				  aq_from_cp(&head), aq_queued(mb));
+			backoff_pause(&b);
+			head = counted_load(&mb->head);
+			continue;
+		}
+
+		/* If next is really NULL, nothing to return */
+		if (counted_get_ptr(next) == NULL) {
+			backoff_done(&b);
+			AQ_STAT_INC(mb, AQ_STAT_DEQ_EMPTY);
+			AQ_PROBE3(atomic_q, dequeue_empty, mb, NULL,
+				  aq_queued(mb));
+			return 0;
+		}
+
+		/* tail wasn't really pointing to the tail.  Advance it
+		 * and iterate
+		 */
+		if (counted_get_ptr(head) == counted_get_ptr(tail)) {
+			(void)AQ_STAT_CAS(mb, AQ_STAT_DEQ_HELP,
+					  counted_compare_and_swap_release(
+						  &mb->tail,
+						  tail,
+						  counted_get_ptr(next),
+						  1));
+			continue;
+		}
+
+		/* Collect up to max elements following the head.  We stop
+		 * at the tail we saw, since the head must never get ahead
+		 * of the tail.  If the head moves while we walk, these
+		 * reads may be of freed elements, but then the CAS below
+		 * fails and we start over.
+		 */
+		el = aq_from_cp(&next);
+		out[0] = el;
+		n = 1;
+		while (n < max && el != aq_from_cp(&tail)) {
+			el = counted_load_ptr(&el->next);
+			if (el == NULL)
+				break;
+			out[n++] = el;
+		}
+
+		/* Move the head over all of them at once.  The counter
+		 * goes up by the number dequeued to keep <aq_queued>
+		 * right.  On failure head is the new head.
+		 */
+		if (AQ_STAT_CAS(mb, AQ_STAT_DEQ_HEAD,
+				counted_compare_exchange_acq_rel(&mb->head,
+								 &head,
+								 out[n-1],
+								 n))) {
+			break;
+		}
+		AQ_PROBE3(atomic_q, dequeue_retry, mb, aq_from_cp(&head),
+			  aq_queued(mb));
+		backoff_pause(&b);
+	}
+	backoff_done(&b);
+	AQ_STAT_ADD(mb, AQ_STAT_DEQUEUE, n);
+
+	/* Free the old head pointer.  The last element we return is the
+	 * new dummy, but the ones before it will never be, so drop the
+	 * queue's reference on them now.
+	 */
+	aq_el_free(mb, aq_from_cp(&head));
+	for (i = 0; i < n - 1; i++)
+		aq_el_free(mb, out[i]);
+
+#ifdef AQ_HAVE_PROBES
+	for (i = 0; i < n; i++)
+		AQ_PROBE3(atomic_q, dequeue, mb, out[i], aq_queued(mb));
+#endif
+	return n;
+}
+
+/*
+ * Compute the time left until deadline into left.  Returns false if
+ * the deadline has already passed.
+ */
+static inline bool
+aq_time_left(const struct timespec *deadline, struct timespec *left)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left->tv_sec = deadline->tv_sec - now.tv_sec;
+	left->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+	if (left->tv_nsec < 0) {
+		left->tv_nsec += 1000000000L;
+		left->tv_sec--;
+	}
+	return (left->tv_sec > 0 ||
+		(left->tv_sec == 0 && left->tv_nsec > 0));
+}
+
+static inline struct atomic_el *
+aq_dequeue_spinwait(struct atomic_q *mb,
+		    const struct timespec *block_policy,
+		    struct aq_waiter *w)
+{
+	struct atomic_el *el;
+	struct timespec deadline, left;
+	uint32_t seq;
+	bool expired = false;
+
+	el = aq_dequeue(mb);
+	if (el != NULL || block_policy == AQ_NONBLOCK)
+		goto out;
+
+	if (block_policy != AQ_BLOCK) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += block_policy->tv_sec;
+		deadline.tv_nsec += block_policy->tv_nsec;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_nsec -= 1000000000L;
+			deadline.tv_sec++;
+		}
+	}
+
+	/* Spin and yield first.  Only look at the head while doing
+	 * so, to keep from bouncing the cache line around.
+	 */
+	if (w != NULL) {
+		while (!aq_wait_spin(w)) {
+			if (!aq_empty(mb) && (el = aq_dequeue(mb)) != NULL)
+				goto out;
+			if (block_policy != AQ_BLOCK &&
+			    (w->iter & 0x3F) == 0 &&
+			    !aq_time_left(&deadline, &left))
+				goto out;
+		}
+		w->parks++;
+	}
+
+	for (;;) {
+		/* Sample the futex word BEFORE announcing ourselves, so that
+		 * any wakeup issued after the announcement changes it and
+		 * futex_wait() returns immediately instead of sleeping.
+		 */
+		seq = *(volatile uint32_t *)&mb->wake_seq;
+		__sync_fetch_and_add(&mb->waiters, 1);
+
+		/* An enqueuer that published before our increment did not
+		 * see us, so re-check the queue before going to sleep.
+		 */
+		if (aq_empty(mb)) {
+			if (block_policy != AQ_BLOCK)
+				expired = !aq_time_left(&deadline, &left);
+			if (!expired)
+				futex_wait(&mb->wake_seq,
+					   seq,
+					   block_policy == AQ_BLOCK ?
+					   NULL : &left);
+		}
+
+		__sync_fetch_and_sub(&mb->waiters, 1);
+
+		el = aq_dequeue(mb);
+		if (el != NULL || expired)
+			goto out;
+	}
+
+out:
+	if (w != NULL)
+		aq_wait_done(w);
+	return el;
+}
+
+static inline struct atomic_el *
+aq_dequeue_wait(struct atomic_q *mb, const struct timespec *block_policy)
+{
+	return aq_dequeue_spinwait(mb, block_policy, NULL);
+}
+
 #endif
@@ -0,0 +1,227 @@
+#ifndef __ATOMIC_RING_H__
+#define __ATOMIC_RING_H__
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*****************************************************************************
+ * This header file implements a bounded, array based FIFO queue that
+ * supports multiple enqueuers and multiple dequeuers concurrently.  It is
+ * the algorithm described by Dmitry Vyukov in "Bounded MPMC queue"
+ * (http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue)
+ *
+ * Unlike atomic_q.h, elements need no embedded struct atomic_el and there
+ * is no freeer.  The ring stores plain pointers, and a pointer handed to
+ * <ar_try_dequeue> is never touched by the ring again.  The capacity is
+ * fixed at initialization time, which makes it exact: <ar_try_enqueue>
+ * fails when the ring is full, so producers get backpressure without
+ * polling a counter.
+ *
+ * Each slot (cell) carries a sequence number that says whose turn it is:
+ *     seq == pos            the slot is free for the enqueuer at pos
+ *     seq == pos + 1        the slot holds the element for the dequeuer
+ *                           at pos
+ *     seq == pos + capacity the dequeuer is done, the slot is free for
+ *                           the enqueuer one lap later
+ * so enqueuers and dequeuers each only contend on their own position
+ * counter and never on each other's.
+ *
+ * The cells live directly after the struct atomic_ring, so the whole ring
+ * is one block of memory and can be placed in shared memory.  Allocate
+ * ar_size(capacity) bytes, 64 byte aligned.
+ *
+ * An example:
+ *
+ * struct atomic_ring *r = aligned_alloc(64, ar_size(1024));
+ * ar_init(r, 1024);
+ *   ...
+ * if (!ar_try_enqueue(r, msg))
+ *    printf("ring is full\n");
+ *   ...
+ * msg = ar_try_dequeue(r);
+ * if (msg == NULL)
+ *    printf("ring was empty\n");
+ ****************************************************************************/
+
+/*****************************************************************************
+ ************************** EXTERNAL INTERFACES ******************************
+ *****************************************************************************/
+
+struct atomic_ring;
+
+/* Bytes needed for a ring with capacity slots */
+#define ar_size(capacity) \
+	(sizeof(struct atomic_ring) + (capacity) * sizeof(struct ar_cell))
+
+/*
+ * Initialize a ring.  capacity must be a power of two, and the ring must
+ * be ar_size(capacity) bytes long.
+ */
+static inline void
+ar_init(struct atomic_ring *r, uint64_t capacity);
+
+/*
+ * Add data to the ring.  data must not be NULL.  Returns false, without
+ * adding anything, if the ring is full.
+ */
+static inline bool
+ar_try_enqueue(struct atomic_ring *r, void *data);
+
+/*
+ * Remove the oldest element from the ring.  Returns NULL if the ring is
+ * empty.
+ */
+static inline void *
+ar_try_dequeue(struct atomic_ring *r);
+
+/*
+ * Return the number of elements in the ring.  This is exact when the
+ * ring is quiescent, and otherwise a snapshot that may be stale by the
+ * time it is returned.
+ */
+static inline uint64_t
+ar_queued(const struct atomic_ring *r);
+
+/* Return the capacity the ring was initialized with. */
+static inline uint64_t
+ar_capacity(const struct atomic_ring *r);
+
+/*****************************************************************************
+ ************************** INTERNAL INTERFACES ******************************
+ *****************************************************************************/
+
+struct ar_cell {
+	uint64_t seq;
+	void *data;
+};
+
+/*
+ * The ring itself.  The enqueue and dequeue positions are on their own
+ * cache lines so producers and consumers do not invalidate each other.
+ */
+struct atomic_ring {
+	uint64_t mask;
+	char _pad1[56];
+	uint64_t enq_pos;
+	char _pad2[56];
+	uint64_t deq_pos;
+	char _pad3[56];
+	struct ar_cell cells[];
+};
+
+static inline void
+ar_init(struct atomic_ring *r, uint64_t capacity)
+{
+	uint64_t i;
+
+	/* capacity must be a power of two */
+	assert(capacity >= 2 && (capacity & (capacity - 1)) == 0);
+
+	r->mask = capacity - 1;
+	r->enq_pos = 0;
+	r->deq_pos = 0;
+	for (i = 0; i < capacity; i++) {
+		r->cells[i].seq = i;
+		r->cells[i].data = NULL;
+	}
+}
+
+static inline bool
+ar_try_enqueue(struct atomic_ring *r, void *data)
+{
+	struct ar_cell *cell;
+	uint64_t pos, seq;
+	int64_t dif;
+
+	assert(data != NULL);
+
+	pos = __atomic_load_n(&r->enq_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &r->cells[pos & r->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (int64_t)(seq - pos);
+
+		if (dif == 0) {
+			/* The slot is free, try to claim it.  On failure
+			 * pos is reloaded with the current position
+			 */
+			if (__atomic_compare_exchange_n(&r->enq_pos,
+							&pos,
+							pos + 1,
+							true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			/* The dequeuer a lap behind us hasn't emptied the
+			 * slot, the ring is full
+			 */
+			return false;
+		} else {
+			/* Somebody else claimed pos, catch up */
+			pos = __atomic_load_n(&r->enq_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	/* The slot is ours.  Publish the data to the dequeuer at pos */
+	cell->data = data;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static inline void *
+ar_try_dequeue(struct atomic_ring *r)
+{
+	struct ar_cell *cell;
+	uint64_t pos, seq;
+	int64_t dif;
+	void *data;
+
+	pos = __atomic_load_n(&r->deq_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &r->cells[pos & r->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (int64_t)(seq - (pos + 1));
+
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&r->deq_pos,
+							&pos,
+							pos + 1,
+							true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			/* Nothing has been enqueued at pos yet */
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&r->deq_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	/* Take the data and hand the slot to the enqueuer one lap on */
+	data = cell->data;
+	__atomic_store_n(&cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+	return data;
+}
+
+static inline uint64_t
+ar_queued(const struct atomic_ring *r)
+{
+	uint64_t deq = __atomic_load_n(&r->deq_pos, __ATOMIC_RELAXED);
+	uint64_t enq = __atomic_load_n(&r->enq_pos, __ATOMIC_RELAXED);
+
+	/* Loading deq first means enq can only have grown, so this
+	 * never goes negative, but it can exceed the capacity.
+	 */
+	return enq - deq > r->mask + 1 ? r->mask + 1 : enq - deq;
+}
+
+static inline uint64_t
+ar_capacity(const struct atomic_ring *r)
+{
+	return r->mask + 1;
+}
+
+#endif
@@ -1,14 +1,23 @@
 #ifndef __ATOMIC_STACK_H__
 #define __ATOMIC_STACK_H__
 
-#include "util/util.h"
+#include <assert.h>
+#include <stdbool.h>
+
+#include "aq_probe.h"
+#include "backoff.h"
+#include "ccas.h"
+#include "epoch.h"
+#include "hazard.h"
+#include "util.h"
 /*****************************************************************************
  * author: Dave Boutcher <daveboutcher@gmail.com>
  *****************************************************************************
  *
  * This header file implements a lockless stack that supports multiple
  * concurrent users.  The only requirement is that the as_head structure
- * be 16 byte aligned (cince it uses the counted_compare_and_swap interfaces)
+ * be COUNTED_ALIGN byte aligned (cince it uses the counted_compare_and_swap
+ * interfaces)
  *
  * An example:
  *
@@ -33,9 +42,25 @@
  *                       struct my_msg,
  *                       ase);
  * ...
+ *
+ * as_pop() reads the next pointer of the top entry, which another thread
+ * may have popped and freed in the meantime.  That is harmless if entries
+ * are never returned to the system.  If they are, pop with as_pop_hp()
+ * and a struct hp_thread from hazard.h, and release popped entries with
+ * hp_retire() rather than freeing them directly.  Or pop with as_pop_ebr()
+ * and release with ebr_retire() from epoch.h.
+ *
+ * What a push or pop does after losing a compare and swap is AS_BACKOFF
+ * (see backoff.h.)  struct as_head is only the counted pointer, with no
+ * room for a policy per stack, so define AS_BACKOFF before including this
+ * to change it.
  *****************************************************************************
  */
 
+#ifndef AS_BACKOFF
+#define AS_BACKOFF BACKOFF_DEFAULT
+#endif
+
 /* Entries pushed on teh stack should have one of these inside them. */
 struct as_entry {
 	struct as_entry *next;
@@ -46,52 +71,181 @@ struct as_head {
 	struct counted_ptr first;
 };
 
+/* The entry below the top of a snapshot of s->first */
+static inline struct as_entry *as_next(struct counted_ptr first)
+{
+	return ((struct as_entry *)counted_get_ptr(first))->next;
+}
+
 /* Stack initializer. */
 static inline void as_init(struct as_head *s)
 {
-	/* The cmpxchg16b instruction requires 16 byte aligned memory */
-	assert(((unsigned long)s & 0x0F) == 0);
+	/* The cmpxchg instructions require aligned memory */
+	assert(((unsigned long)s & (COUNTED_ALIGN - 1)) == 0);
 
-	s->first.ptr = NULL;
-	s->first.ctr = 0;
+	counted_set(&s->first, NULL, 0, false);
 }
 
-/* Atomically push an entry on the stack */
+/*
+ * Atomically push an entry on the stack.  Pushes release the entry to
+ * whoever pops it, and pops acquire it.
+ */
 static inline void as_push(struct as_head *s, struct as_entry *e)
 {
-	struct counted_ptr oldhead;
-	do {
-		oldhead = s->first;
-		e->next = (struct as_entry *)oldhead.ptr;
+	struct counted_ptr oldhead = counted_load_relaxed(&s->first);
+	struct backoff b;
+
+	backoff_init(&b, AS_BACKOFF);
+
+	/* A failed compare and swap leaves the new top in oldhead */
+	for (;;) {
+		e->next = (struct as_entry *)counted_get_ptr(oldhead);
 		assert(e->next != e);
-	} while (!counted_compare_and_swap(&s->first,
-					   oldhead,
-					   e,
-					   1));
+		if (counted_compare_exchange_release(&s->first,
+						     &oldhead,
+						     e,
+						     1))
+			break;
+		backoff_pause(&b);
+	}
+	backoff_done(&b);
+	AQ_PROBE2(atomic_stack, push, s, e);
+}
+
+/*
+ * Atomically push a chain of entries, already linked from first to last
+ * through their next pointers, with a single compare and swap.  first
+ * ends up on top.
+ */
+static inline void as_push_list(struct as_head *s,
+				struct as_entry *first,
+				struct as_entry *last)
+{
+	struct counted_ptr oldhead = counted_load_relaxed(&s->first);
+	struct backoff b;
+
+	backoff_init(&b, AS_BACKOFF);
+	for (;;) {
+		last->next = (struct as_entry *)counted_get_ptr(oldhead);
+		assert(last->next != first);
+		if (counted_compare_exchange_release(&s->first,
+						     &oldhead,
+						     first,
+						     1))
+			break;
+		backoff_pause(&b);
+	}
+	backoff_done(&b);
+	AQ_PROBE3(atomic_stack, push_list, s, first, last);
+}
+
+/*
+ * Try once to push an entry on the stack.  Returns false if another
+ * thread changed the stack under us, so the caller can back off.
+ */
+static inline bool as_try_push(struct as_head *s, struct as_entry *e)
+{
+	struct counted_ptr oldhead = counted_load_relaxed(&s->first);
+
+	e->next = (struct as_entry *)counted_get_ptr(oldhead);
+	assert(e->next != e);
+	return counted_compare_and_swap_release(&s->first, oldhead, e, 1);
+}
+
+/*
+ * Try once to pop an entry from the stack into *e.  Returns false if
+ * another thread changed the stack under us.  If the stack is empty this
+ * succeeds with *e set to NULL.
+ */
+static inline bool as_try_pop(struct as_head *s, struct as_entry **e)
+{
+	struct counted_ptr ret = counted_load(&s->first);
+
+	*e = counted_get_ptr(ret);
+	if (counted_get_ptr(ret) == NULL)
+		return true;
+	return counted_compare_and_swap_acquire(&s->first,
+						ret,
+						(*e)->next,
+						1);
+}
+
+/*
+ * Atomically pop an entry from the stack, protecting the top entry with a
+ * hazard pointer while we read it.  ht may be NULL, which makes this the
+ * same as as_pop().
+ */
+static inline struct as_entry *as_pop_hp(struct as_head *s,
+					 struct hp_thread *ht)
+{
+	struct counted_ptr ret;
+	struct backoff b;
+
+	backoff_init(&b, AS_BACKOFF);
+	ret = ht ? hp_protect(ht, 0, &s->first) : counted_load(&s->first);
+	while (counted_get_ptr(ret) != NULL &&
+	       !counted_compare_exchange_acquire(&s->first,
+						 &ret,
+						 as_next(ret),
+						 1)) {
+		backoff_pause(&b);
+		/*
+		 * ret is now the new top, read with acquire, but nothing
+		 * protects it
+		 */
+		if (ht)
+			ret = hp_protect(ht, 0, &s->first);
+	}
+	backoff_done(&b);
+	if (ht)
+		hp_clear(ht, 0);
+	AQ_PROBE2(atomic_stack, pop, s, counted_get_ptr(ret));
+	return counted_get_ptr(ret);
 }
 
 /* Atomically pop an entry from the stack */
 static inline struct as_entry *as_pop(struct as_head *s)
 {
-	struct counted_ptr ret;
+	return as_pop_hp(s, NULL);
+}
 
-	do {
-		ret = s->first;
+/*
+ * Atomically pop an entry from the stack inside an epoch critical
+ * section (a no-op for QSBR domains.)
+ */
+static inline struct as_entry *as_pop_ebr(struct as_head *s,
+					  struct ebr_thread *et)
+{
+	struct as_entry *e;
 
-		if (ret.ptr == NULL)
-			return ret.ptr;
+	ebr_enter(et);
+	e = as_pop(s);
+	ebr_exit(et);
+	return e;
+}
+
+/*
+ * Atomically take every entry on the stack.  Returns the top entry, linked
+ * through the next pointers down to NULL, or NULL if the stack was empty.
+ * The chain is private to the caller afterwards.
+ */
+static inline struct as_entry *as_pop_all(struct as_head *s)
+{
+	struct counted_ptr ret = counted_load_relaxed(&s->first);
+	struct backoff b;
 
-	} while (!counted_compare_and_swap(&s->first,
-					   ret,
-					   ((struct as_entry *)(ret.ptr))->next,
-					   1));
-	return ret.ptr;
+	backoff_init(&b, AS_BACKOFF);
+	while (counted_get_ptr(ret) != NULL &&
+	       !counted_compare_exchange_acquire(&s->first, &ret, NULL, 1))
+		backoff_pause(&b);
+	backoff_done(&b);
+	return counted_get_ptr(ret);
 }
 
 /* Return true if the stack is empty */
 static inline bool as_empty(struct as_head *s)
 {
-	return (s->first.ptr == NULL);
+	return (counted_load_ptr(&s->first) == NULL);
 }
 
 #endif /* __UTIL_ATIMIC_STACK_H__ */
@@ -0,0 +1,153 @@
+#ifndef __BACKOFF_H__
+#define __BACKOFF_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "util.h"
+
+/*****************************************************************************
+ * Backoff after a failed compare and swap.
+ *
+ * Retrying straight away after losing a compare and swap sends the thread
+ * back to the same contended cache line while the winner still needs it,
+ * which is the worst thing to do exactly when contention is highest.
+ * Waiting a little, with cpu_relax() (PAUSE), lets the line settle.  How
+ * long to wait is the policy:
+ *
+ *     BACKOFF_NONE          retry at once
+ *     BACKOFF_EXP           BACKOFF_MIN_SPIN PAUSEs after the first failure,
+ *                           doubling with each further one, up to
+ *                           BACKOFF_MAX_SPIN
+ *     BACKOFF_RANDOM        a random number of PAUSEs below that same
+ *                           limit, so threads that collided once don't
+ *                           collide again in step
+ *     BACKOFF_PROPORTIONAL  BACKOFF_MIN_SPIN PAUSEs for every failure the
+ *                           thread has been seeing per operation lately,
+ *                           and per failure so far in this one
+ *
+ * A retry loop keeps a struct backoff on its stack:
+ *
+ * struct backoff b;
+ *
+ * backoff_init(&b, mode);
+ * while (!compare_and_swap(...))
+ *         backoff_pause(&b);
+ * backoff_done(&b);
+ *
+ * The random seed and the failure average for BACKOFF_PROPORTIONAL are
+ * per thread, in thread local storage, so they carry over from one
+ * operation to the next without any shared writes.
+ *
+ * BACKOFF_DEFAULT is the policy structures use unless told otherwise.
+ * Define it before including any of the headers to change it.
+ ****************************************************************************/
+
+enum backoff_mode {
+	BACKOFF_NONE,		/* retry at once */
+	BACKOFF_EXP,		/* exponential */
+	BACKOFF_RANDOM,		/* randomized truncated exponential */
+	BACKOFF_PROPORTIONAL,	/* proportional to recent failures */
+};
+
+#ifndef BACKOFF_DEFAULT
+#define BACKOFF_DEFAULT BACKOFF_NONE
+#endif
+
+/* Bounds for one pause (in PAUSE iterations) */
+#ifndef BACKOFF_MIN_SPIN
+#define BACKOFF_MIN_SPIN (4)
+#endif
+#ifndef BACKOFF_MAX_SPIN
+#define BACKOFF_MAX_SPIN (1024)
+#endif
+
+struct backoff {
+	enum backoff_mode mode;
+	uint32_t fails;		/* failures in the current operation */
+};
+
+/* Per-thread backoff state */
+struct backoff_thread {
+	uint32_t seed;
+	uint32_t avg;		/* moving average of fails per operation, << 4 */
+};
+
+static __thread struct backoff_thread backoff_self;
+
+/* Start an operation that may have to retry */
+static inline void backoff_init(struct backoff *b, enum backoff_mode mode)
+{
+	b->mode = mode;
+	b->fails = 0;
+}
+
+static inline uint32_t backoff_random(void)
+{
+	struct backoff_thread *t = &backoff_self;
+	uint32_t x = t->seed;
+
+	if (x == 0)
+		x = (uint32_t)(uintptr_t)t | 1;
+
+	/* xorshift32 */
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	t->seed = x;
+	return x;
+}
+
+/* How many PAUSEs the next pause should be */
+static inline uint32_t backoff_spins(struct backoff *b)
+{
+	uint32_t limit;
+
+	switch (b->mode) {
+	case BACKOFF_EXP:
+	case BACKOFF_RANDOM:
+		limit = BACKOFF_MAX_SPIN;
+		if (b->fails < 31 &&
+		    ((uint32_t)BACKOFF_MIN_SPIN << b->fails) < limit)
+			limit = BACKOFF_MIN_SPIN << b->fails;
+		if (b->mode == BACKOFF_RANDOM)
+			return backoff_random() % limit + 1;
+		return limit;
+	case BACKOFF_PROPORTIONAL:
+		limit = ((backoff_self.avg >> 4) + b->fails + 1) *
+			BACKOFF_MIN_SPIN;
+		return limit < BACKOFF_MAX_SPIN ? limit : BACKOFF_MAX_SPIN;
+	default:
+		return 0;
+	}
+}
+
+/* Called after each failed compare and swap, before trying again */
+static inline void backoff_pause(struct backoff *b)
+{
+	uint32_t i, n;
+
+	if (b->mode == BACKOFF_NONE)
+		return;
+
+	n = backoff_spins(b);
+	b->fails++;
+	for (i = 0; i < n; i++)
+		cpu_relax();
+}
+
+/*
+ * Called once the operation has succeeded.  Feeds its failures into the
+ * average for BACKOFF_PROPORTIONAL.
+ */
+static inline void backoff_done(struct backoff *b)
+{
+	struct backoff_thread *t = &backoff_self;
+
+	if (b->mode != BACKOFF_PROPORTIONAL)
+		return;
+
+	t->avg += (int32_t)((b->fails << 4) - t->avg) >> 3;
+}
+
+#endif
@@ -1,17 +1,397 @@
 #ifndef __CCAS_H__
 #define __CCAS_H__
 
+#include <assert.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 /*
  * This data structure is the pointer/counter tuple used by the
  * 16 byte compare and swap.  These MUST be 16 byte aligned.
+ *
+ * Besides the counter, each counted pointer carries one flag bit that
+ * compare and swap leaves alone (atomic_q.h keeps a reference count in
+ * it.)  Only touch the fields through the counted_ functions below, since
+ * the layout changes with CCAS_TAGGED.
+ *
+ * Build with -DCCAS_TAGGED to pack everything into a single 8 byte word
+ * instead, updated with a plain lock cmpxchg.  This relies on x86-64 user
+ * space pointers fitting in the low 48 bits, and keeps the counter in bits
+ * 48-62 and the flag in bit 63.  Links in struct atomic_el, struct atomic_q
+ * and struct as_head shrink to 8 bytes, but the counter wraps after 32768
+ * updates, so a thread that sleeps through exactly that many operations on
+ * the same location can still be fooled by ABA.  Queue lengths from
+ * aq_queued() are also only meaningful up to 16383.
  */
+#ifdef CCAS_TAGGED
+
+struct counted_ptr {
+	uint64_t tagged;
+} __attribute__((aligned(8)));
+
+#define COUNTED_ALIGN (8)
+#define COUNTED_PTR_MASK ((1UL << 48) - 1)
+#define COUNTED_CTR_SHIFT (48)
+#define COUNTED_CTR_BITS (15)
+#define COUNTED_FLAG (1UL << 63)
+
+#else
+
 struct counted_ptr {
-	void *ptr;
-	int64_t ctr;
+	union {
+		struct {
+			void *ptr;
+			int64_t ctr;
+		};
+		unsigned __int128 word;	/* what compare and swap sees */
+	};
 } __attribute__((aligned(16)));
 
+#define COUNTED_ALIGN (16)
+#define COUNTED_CTR_BITS (63)
+#define COUNTED_FLAG (1UL << 63)
+
+#endif
+
+#define COUNTED_CTR_MASK ((1UL << COUNTED_CTR_BITS) - 1)
+
+/* Build a counted pointer value */
+static inline struct counted_ptr counted_make(void *ptr, int64_t ctr, bool flag)
+{
+	struct counted_ptr c;
+
+#ifdef CCAS_TAGGED
+	assert(((uint64_t)ptr & ~COUNTED_PTR_MASK) == 0);
+	c.tagged = (uint64_t)ptr |
+		   ((uint64_t)ctr & COUNTED_CTR_MASK) << COUNTED_CTR_SHIFT |
+		   (flag ? COUNTED_FLAG : 0);
+#else
+	c.ptr = ptr;
+	c.ctr = (ctr & COUNTED_CTR_MASK) | (flag ? COUNTED_FLAG : 0);
+#endif
+	return c;
+}
+
+/* The parts of a counted pointer value */
+static inline void *counted_get_ptr(struct counted_ptr c)
+{
+#ifdef CCAS_TAGGED
+	return (void *)(c.tagged & COUNTED_PTR_MASK);
+#else
+	return c.ptr;
+#endif
+}
+
+static inline int64_t counted_get_ctr(struct counted_ptr c)
+{
+#ifdef CCAS_TAGGED
+	return (c.tagged >> COUNTED_CTR_SHIFT) & COUNTED_CTR_MASK;
+#else
+	return c.ctr & COUNTED_CTR_MASK;
+#endif
+}
+
+static inline bool counted_get_flag(struct counted_ptr c)
+{
+#ifdef CCAS_TAGGED
+	return (c.tagged & COUNTED_FLAG) != 0;
+#else
+	return (c.ctr & COUNTED_FLAG) != 0;
+#endif
+}
+
+/*
+ * a's counter minus b's, allowing for the counter wrapping.  Only
+ * meaningful while the real difference fits in COUNTED_CTR_BITS - 1 bits.
+ */
+static inline int64_t counted_ctr_diff(struct counted_ptr a,
+				       struct counted_ptr b)
+{
+	const int shift = 64 - COUNTED_CTR_BITS;
+	uint64_t d = counted_get_ctr(a) - counted_get_ctr(b);
+
+	/* sign extend */
+	return (int64_t)(d << shift) >> shift;
+}
+
+/*
+ * Non-atomic updates, for counted pointers no other thread can be
+ * writing.
+ */
+static inline void counted_set(struct counted_ptr *cp,
+			       void *ptr,
+			       int64_t ctr,
+			       bool flag)
+{
+	*cp = counted_make(ptr, ctr, flag);
+}
+
+/* Change the pointer, keeping the counter and flag */
+static inline void counted_set_ptr(struct counted_ptr *cp, void *ptr)
+{
+	*cp = counted_make(ptr, counted_get_ctr(*cp), counted_get_flag(*cp));
+}
+
+/* Change the counter, keeping the pointer and flag */
+static inline void counted_set_ctr(struct counted_ptr *cp, int64_t ctr)
+{
+	*cp = counted_make(counted_get_ptr(*cp), ctr, counted_get_flag(*cp));
+}
+
+/*
+ * GCC 7 and later send 16 byte __atomic operations to libatomic, even
+ * when -mcx16 says the CPU has cmpxchg16b, but still expand the older
+ * __sync builtin inline.  That one takes no memory order; it is a full
+ * barrier, which is what the lock prefix does anyway.  clang inlines the
+ * __atomic version.
+ */
+#if !defined(CCAS_TAGGED) && !defined(__clang__) && \
+	defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+#define CCAS_SYNC16
+#endif
+
+/*
+ * Read a counted pointer that other threads may be changing, with the
+ * given __ATOMIC_ memory order (relaxed, acquire or seq_cst.)  The two
+ * halves are read separately, so the result can be torn, but a torn value
+ * never matches in a compare and swap.  What matters is that each half is
+ * read exactly once, so the compiler can't read it again between taking
+ * the snapshot and the compare and swap.
+ *
+ * Use <counted_load> for a snapshot that is going to be the old value of
+ * a compare and swap.  This is for re-reading to check that nothing has
+ * changed since then: a torn value only comes from a change, so it is
+ * the right answer anyway.
+ */
+static inline struct counted_ptr
+counted_read_order(const struct counted_ptr *cp, int order)
+{
+	struct counted_ptr c;
+
+#ifdef CCAS_TAGGED
+	c.tagged = __atomic_load_n(&cp->tagged, order);
+#else
+	c.ptr = __atomic_load_n(&cp->ptr, order);
+	c.ctr = __atomic_load_n(&cp->ctr, order);
+#endif
+	return c;
+}
+
+/*
+ * Read with acquire ordering, for snapshots the caller is going to follow
+ * the pointer of.
+ */
+static inline struct counted_ptr counted_read(const struct counted_ptr *cp)
+{
+	return counted_read_order(cp, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Read with no ordering, for snapshots that are only compared or handed
+ * to a compare and swap.
+ */
+static inline struct counted_ptr
+counted_read_relaxed(const struct counted_ptr *cp)
+{
+	return counted_read_order(cp, __ATOMIC_RELAXED);
+}
+
+/*
+ * Intel and AMD both guarantee that an aligned 16 byte SSE load (movdqa)
+ * is atomic on any CPU that has AVX.  Older CPUs only promise it for
+ * lock cmpxchg16b.
+ */
+#if !defined(CCAS_TAGGED) && defined(__x86_64__) && \
+	defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+#define CCAS_LOAD_SSE
+
+typedef long long counted_vec __attribute__((vector_size(16)));
+
+static inline bool counted_sse_atomic(void)
+{
+#ifdef __AVX__
+	return true;
+#else
+	return __builtin_cpu_supports("avx");
+#endif
+}
+#endif
+
+/*
+ * Atomically load a whole counted pointer, with the given __ATOMIC_
+ * memory order.  Unlike <counted_read_order> the pointer and counter
+ * always come from the same moment, so a snapshot taken just as another
+ * thread changes mem can't be torn and make the following compare and
+ * swap fail for nothing.
+ *
+ * With CCAS_TAGGED this is a plain load.  Otherwise, on x86-64 with
+ * -mcx16 it is a movdqa if the CPU has AVX (checked once at compile time
+ * with -mavx, or else each call with a well predicted branch) and a lock
+ * cmpxchg16b of 0 with 0 if not.  The lock cmpxchg16b writes, which
+ * takes the cache line exclusive, so on those CPUs this is no cheaper
+ * than the compare and swap that follows.  Everywhere else it is
+ * __atomic_load_n(), which libatomic does the same way.
+ */
+static inline struct counted_ptr
+counted_load_order(const struct counted_ptr *cp, int order)
+{
+	struct counted_ptr c;
+
+#if defined(CCAS_TAGGED)
+	c.tagged = __atomic_load_n(&cp->tagged, order);
+#elif defined(CCAS_LOAD_SSE)
+	if (counted_sse_atomic()) {
+		counted_vec v;
+
+		/* x86 loads are already acquire, and a seq_cst load only
+		 * needs the stores around it to be fenced.  All that is
+		 * left is keeping the compiler in order.
+		 */
+		if (order == __ATOMIC_SEQ_CST)
+			__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		v = *(const volatile counted_vec *)cp;
+		if (order != __ATOMIC_RELAXED)
+			__atomic_signal_fence(__ATOMIC_ACQUIRE);
+		__builtin_memcpy(&c, &v, sizeof(c));
+	} else {
+		c.word = __sync_val_compare_and_swap(
+			(unsigned __int128 *)&cp->word, 0, 0);
+	}
+#else
+	c.word = __atomic_load_n(&cp->word, order);
+#endif
+	return c;
+}
+
+/* Atomic load with acquire ordering */
+static inline struct counted_ptr counted_load(const struct counted_ptr *cp)
+{
+	return counted_load_order(cp, __ATOMIC_ACQUIRE);
+}
+
+/* Atomic load with no ordering */
+static inline struct counted_ptr
+counted_load_relaxed(const struct counted_ptr *cp)
+{
+	return counted_load_order(cp, __ATOMIC_RELAXED);
+}
+
+/* Load just the pointer, with acquire ordering */
+static inline void *counted_load_ptr(const struct counted_ptr *cp)
+{
+#ifdef CCAS_TAGGED
+	return (void *)(__atomic_load_n(&cp->tagged, __ATOMIC_ACQUIRE) &
+			COUNTED_PTR_MASK);
+#else
+	return __atomic_load_n(&cp->ptr, __ATOMIC_ACQUIRE);
+#endif
+}
+
+/*
+ * Publish ptr in a counted pointer whose pointer is NULL, with release
+ * ordering, leaving the counter and flag alone even if another thread is
+ * toggling the flag.  A plain store normally, a lock or in tagged mode.
+ */
+static inline void counted_link(struct counted_ptr *cp, void *ptr)
+{
+#ifdef CCAS_TAGGED
+	assert(((uint64_t)ptr & ~COUNTED_PTR_MASK) == 0);
+	__atomic_fetch_or(&cp->tagged, (uint64_t)ptr, __ATOMIC_RELEASE);
+#else
+	__atomic_store_n(&cp->ptr, ptr, __ATOMIC_RELEASE);
+#endif
+}
+
+/* Atomically toggle the flag.  Returns the old flag. */
+static inline bool counted_toggle_flag(struct counted_ptr *cp)
+{
+#ifdef CCAS_TAGGED
+	return (__sync_fetch_and_xor(&cp->tagged, COUNTED_FLAG) &
+		COUNTED_FLAG) != 0;
+#else
+	return (__sync_fetch_and_xor((uint64_t *)&cp->ctr, COUNTED_FLAG) &
+		COUNTED_FLAG) != 0;
+#endif
+}
+
+/*
+ * Toggle the flag when the caller is the only thread that ever changes
+ * it.  Other threads may still <counted_link> the pointer, which only
+ * needs an atomic in tagged mode.  Returns the old flag.
+ */
+static inline bool counted_toggle_flag_excl(struct counted_ptr *cp)
+{
+#ifdef CCAS_TAGGED
+	return counted_toggle_flag(cp);
+#else
+	cp->ctr ^= COUNTED_FLAG;
+	return (cp->ctr & COUNTED_FLAG) == 0;
+#endif
+}
+
+/*
+ * Compare and swap the whole of a counted pointer: if *mem equals
+ * *expected, store new and return true.  Otherwise copy what was in *mem
+ * to *expected and return false.  success and failure are __ATOMIC_
+ * memory orders, as for __atomic_compare_exchange_n().
+ *
+ * The instruction leaves the value it found in registers either way, so
+ * handing it back costs nothing.
+ */
+static inline bool counted_cmpxchg_order(struct counted_ptr *mem,
+					 struct counted_ptr *expected,
+					 struct counted_ptr new,
+					 int success,
+					 int failure)
+{
+#if defined(CCAS_TAGGED)
+	return __atomic_compare_exchange_n(&mem->tagged, &expected->tagged,
+					   new.tagged, false,
+					   success, failure);
+#elif defined(CCAS_SYNC16)
+	unsigned __int128 seen;
+
+	(void)success;
+	(void)failure;
+	seen = __sync_val_compare_and_swap(&mem->word, expected->word,
+					   new.word);
+	if (seen == expected->word)
+		return true;
+	expected->word = seen;
+	return false;
+#else
+	return __atomic_compare_exchange_n(&mem->word, &expected->word,
+					   new.word, false,
+					   success, failure);
+#endif
+}
+
+/*
+ * The same, when the caller has no use for the value found on failure.
+ */
+static inline bool counted_cas_order(struct counted_ptr *mem,
+				     struct counted_ptr old,
+				     struct counted_ptr new,
+				     int success,
+				     int failure)
+{
+	return counted_cmpxchg_order(mem, &old, new, success, failure);
+}
+
+/*
+ * A failed compare and swap is just a load, and needs no more ordering
+ * than a successful one.  The __atomic builtins won't take release or
+ * acq_rel for it.
+ */
+static inline int counted_failure_order(int order)
+{
+	if (order == __ATOMIC_SEQ_CST)
+		return __ATOMIC_SEQ_CST;
+	if (order == __ATOMIC_ACQUIRE || order == __ATOMIC_ACQ_REL)
+		return __ATOMIC_ACQUIRE;
+	return __ATOMIC_RELAXED;
+}
+
 /*
  * 16 byte compare and swap.  This has the same semantics as the
  * __sync_bool_compare_and_swap, only using 16 byte values
@@ -19,41 +399,161 @@ struct counted_ptr {
  * atomically compare old and mem, if they are the same then copy new
  * back to mem.
  *
- * The pseudo-code for the CMPXCHG instruction is:
- * if(EDX:EAX == Destination) {
- *    ZF = 1;
- *    Destination = ECX:EBX;
- * } else {
- *    ZF = 0;
- *    EDX:EAX = Destination;
- * }
- *
- * The counter is incremented by the inc value
+ * The counter is incremented by the inc value.  The flag is copied from
+ * old.  order is the __ATOMIC_ memory order on success; the _acquire,
+ * _release and _relaxed versions below are shorthand for it.  On x86 the
+ * instruction is a full barrier whatever the order, but a weaker order
+ * still lets the compiler move other accesses around it, and is what a
+ * weakly ordered CPU needs to be both correct and fast.
  *
- * NOTE: This will NOT compile if the -fPIC (position independent code)
- *       gcc option is used, since EBX is used in PIC code generation.
- *       See http://www.technovelty.org/code/arch/pic-cas.html
+ * This is lock cmpxchg16b (lock cmpxchg with CCAS_TAGGED), generated by
+ * the compiler rather than inline assembly, so it is fine with -fPIC and
+ * only orders memory as much as it says it does.  Build with -mcx16 so
+ * it is inlined; without it GCC calls libatomic and needs -latomic.
  */
+static inline int counted_compare_and_swap_order(struct counted_ptr *mem,
+						 struct counted_ptr old,
+						 void *newptr,
+						 int64_t inc,
+						 int order) {
+	struct counted_ptr new;
+
+	/* The cmpxchg instructions require aligned memory */
+	assert(((unsigned long)mem & (COUNTED_ALIGN - 1)) == 0);
+	assert(inc > 0);
+
+	new = counted_make(newptr, counted_get_ctr(old) + inc,
+			   counted_get_flag(old));
+
+	return counted_cas_order(mem, old, new, order,
+				 counted_failure_order(order));
+}
+
+/* A full barrier, like __sync_bool_compare_and_swap */
 static inline int counted_compare_and_swap(struct counted_ptr *mem,
 					   struct counted_ptr old,
 					   void *newptr,
 					   int64_t inc) {
-	char result;
+	return counted_compare_and_swap_order(mem, old, newptr, inc,
+					      __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Acquire: nothing after it can move before it.  For taking something
+ * out of a structure.
+ */
+static inline int counted_compare_and_swap_acquire(struct counted_ptr *mem,
+						   struct counted_ptr old,
+						   void *newptr,
+						   int64_t inc) {
+	return counted_compare_and_swap_order(mem, old, newptr, inc,
+					      __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Release: nothing before it can move after it.  For publishing
+ * something the caller initialized.
+ */
+static inline int counted_compare_and_swap_release(struct counted_ptr *mem,
+						   struct counted_ptr old,
+						   void *newptr,
+						   int64_t inc) {
+	return counted_compare_and_swap_order(mem, old, newptr, inc,
+					      __ATOMIC_RELEASE);
+}
+
+/* Relaxed: atomic, but orders nothing */
+static inline int counted_compare_and_swap_relaxed(struct counted_ptr *mem,
+						   struct counted_ptr old,
+						   void *newptr,
+						   int64_t inc) {
+	return counted_compare_and_swap_order(mem, old, newptr, inc,
+					      __ATOMIC_RELAXED);
+}
+
+/*
+ * Like counted_compare_and_swap_order(), but on failure *expected is
+ * updated to what is in mem now, as with C11's
+ * atomic_compare_exchange_strong().  Retry loops can go round again with
+ * that instead of reading mem a second time, which under contention is
+ * another cache miss.  The new value is built from *expected, so the
+ * counter and flag follow it.
+ *
+ * On failure *expected is a single atomic read of mem (never torn) with
+ * the failure order, which is acquire for the _acquire and _acq_rel
+ * versions.  A caller that follows the pointer it gets back needs one of
+ * those.
+ */
+static inline bool counted_compare_exchange_order(struct counted_ptr *mem,
+						  struct counted_ptr *expected,
+						  void *newptr,
+						  int64_t inc,
+						  int order)
+{
 	struct counted_ptr new;
 
-	/* The cmpxchg16b instruction requires 16 byte aligned memory */
-	assert(((unsigned long)mem & 0x0F) == 0);
+	/* The cmpxchg instructions require aligned memory */
+	assert(((unsigned long)mem & (COUNTED_ALIGN - 1)) == 0);
 	assert(inc > 0);
 
-	new.ptr = newptr;
-	new.ctr = old.ctr+inc;
+	new = counted_make(newptr, counted_get_ctr(*expected) + inc,
+			   counted_get_flag(*expected));
+
+	return counted_cmpxchg_order(mem, expected, new, order,
+				     counted_failure_order(order));
+}
+
+static inline bool counted_compare_exchange(struct counted_ptr *mem,
+					    struct counted_ptr *expected,
+					    void *newptr,
+					    int64_t inc)
+{
+	return counted_compare_exchange_order(mem, expected, newptr, inc,
+					      __ATOMIC_SEQ_CST);
+}
+
+static inline bool
+counted_compare_exchange_acquire(struct counted_ptr *mem,
+				 struct counted_ptr *expected,
+				 void *newptr,
+				 int64_t inc)
+{
+	return counted_compare_exchange_order(mem, expected, newptr, inc,
+					      __ATOMIC_ACQUIRE);
+}
 
-	__asm__ __volatile__("lock; cmpxchg16b %0; setz %1;"
-			     : "=m"(*mem), "=q"(result)
-			     : "m"(*mem), "d" (old.ctr), "a" (old.ptr),
-			       "c" (new.ctr), "b" (new.ptr)
-			     : "memory");
-	return (int)result;
+static inline bool
+counted_compare_exchange_release(struct counted_ptr *mem,
+				 struct counted_ptr *expected,
+				 void *newptr,
+				 int64_t inc)
+{
+	return counted_compare_exchange_order(mem, expected, newptr, inc,
+					      __ATOMIC_RELEASE);
+}
+
+/*
+ * Acquire and release together: for publishing when the caller will
+ * also follow the pointer it gets back on failure.
+ */
+static inline bool
+counted_compare_exchange_acq_rel(struct counted_ptr *mem,
+				 struct counted_ptr *expected,
+				 void *newptr,
+				 int64_t inc)
+{
+	return counted_compare_exchange_order(mem, expected, newptr, inc,
+					      __ATOMIC_ACQ_REL);
+}
+
+static inline bool
+counted_compare_exchange_relaxed(struct counted_ptr *mem,
+				 struct counted_ptr *expected,
+				 void *newptr,
+				 int64_t inc)
+{
+	return counted_compare_exchange_order(mem, expected, newptr, inc,
+					      __ATOMIC_RELAXED);
 }
 
 /* Return true of two counted pointers (including the counters) are
@@ -62,8 +562,11 @@ static inline int counted_compare_and_swap(struct counted_ptr *mem,
 static inline bool counted_ptr_eq(struct counted_ptr a,
 				  struct counted_ptr b)
 {
-	return ((a.ptr == b.ptr) &&
-		(a.ctr == b.ctr));
+#ifdef CCAS_TAGGED
+	return a.tagged == b.tagged;
+#else
+	return a.word == b.word;
+#endif
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,358 @@
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*****************************************************************************
+ * Epoch based reclamation (EBR) and quiescent state based reclamation
+ * (QSBR), as described in "Practical lock-freedom" by Keir Fraser (2004)
+ * and "Performance of memory reclamation for lockless synchronization" by
+ * Hart, McKenney, Demke Brown and Walpole (2007).
+ *
+ * Like hazard.h this lets atomic_q.h and atomic_stack.h hand elements back
+ * to the system, but instead of protecting each pointer it tracks when
+ * threads may hold references at all:
+ *
+ * EBR_EPOCH:  a thread brackets each operation with <ebr_enter> and
+ *             <ebr_exit>.  The queue and stack _ebr calls do this for you.
+ *             Entering costs one locked store.
+ *
+ * EBR_QSBR:   the read side costs nothing at all.  Instead each thread
+ *             promises to call <ebr_quiescent> regularly, at a point where
+ *             it holds no references into any structure in the domain
+ *             (e.g. between messages), or go <ebr_thread_offline>.  One
+ *             thread that never does so stops all reclamation.
+ *
+ * There is a global epoch.  It can only advance once every thread that
+ * may hold references has been seen in the current epoch, so memory
+ * retired in epoch e is safe to free once the global epoch reaches e + 2.
+ * Retired memory collects in per-thread limbo lists, one per epoch, and
+ * whole lists are handed to their free functions at once.
+ *
+ * The number of entries waiting in limbo is available from <ebr_pending>
+ * (one thread) and <ebr_domain_pending> (all threads.)  A thread's limbo
+ * is only freed by its own calls, and the epoch is only pushed forward
+ * every EBR_BATCH retires and when a thread goes offline or away.  So a
+ * thread that has stopped retiring, or whose ebr_pending() has grown too
+ * big, drains its limbo now with
+ *
+ * ebr_try_advance(t->dom);
+ * ebr_reclaim(t);
+ *
+ * which frees whatever has waited out its grace period.  That takes two
+ * epochs, so it may need repeating (between quiescent states, for QSBR.)
+ ****************************************************************************/
+
+/* Maximum number of threads in a domain at the same time */
+#ifndef EBR_MAX_THREADS
+#define EBR_MAX_THREADS (64)
+#endif
+
+/* Try to advance the epoch every time this many entries are retired */
+#define EBR_BATCH (64)
+
+enum ebr_mode {
+	EBR_EPOCH,
+	EBR_QSBR,
+};
+
+struct ebr_retired {
+	void *ptr;
+	void (*fn)(void *arg, void *ptr);
+	void *arg;
+};
+
+/* Entries retired in one epoch */
+struct ebr_limbo {
+	uint64_t epoch;
+	int count;
+	int cap;
+	struct ebr_retired *items;
+};
+
+/*
+ * Per-thread record.  state is the last epoch the thread was seen in,
+ * shifted up by one, with the low bit set while the thread may hold
+ * references (inside ebr_enter()/ebr_exit() for EBR, online for QSBR.)
+ * Only state is read by other threads.
+ */
+struct ebr_thread {
+	uint64_t state;
+	struct ebr_domain *dom;
+	int in_use;
+	int pending;
+	struct ebr_limbo limbo[3];
+} __attribute__((aligned(64)));
+
+struct ebr_domain {
+	enum ebr_mode mode;
+	char _pad1[60];
+	uint64_t epoch;
+	char _pad2[56];
+	struct ebr_thread threads[EBR_MAX_THREADS];
+};
+
+/* Initialize a domain in the given mode. */
+static inline void ebr_domain_init(struct ebr_domain *dom, enum ebr_mode mode)
+{
+	struct ebr_thread *t;
+	int i, b;
+
+	dom->mode = mode;
+	dom->epoch = 0;
+	for (i = 0; i < EBR_MAX_THREADS; i++) {
+		t = &dom->threads[i];
+		t->state = 0;
+		t->dom = dom;
+		t->in_use = 0;
+		t->pending = 0;
+		for (b = 0; b < 3; b++) {
+			t->limbo[b].epoch = 0;
+			t->limbo[b].count = 0;
+			t->limbo[b].cap = 0;
+			t->limbo[b].items = NULL;
+		}
+	}
+}
+
+/*
+ * Advance the global epoch if every thread that may hold references has
+ * been seen in it.  Returns true if the epoch moved (by us or somebody
+ * else.)
+ */
+static inline bool ebr_try_advance(struct ebr_domain *dom)
+{
+	uint64_t e, s;
+	int i;
+
+	/* Order the unlinking of retired entries before reading states */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	e = __atomic_load_n(&dom->epoch, __ATOMIC_ACQUIRE);
+	for (i = 0; i < EBR_MAX_THREADS; i++) {
+		if (!__atomic_load_n(&dom->threads[i].in_use, __ATOMIC_ACQUIRE))
+			continue;
+		s = __atomic_load_n(&dom->threads[i].state, __ATOMIC_ACQUIRE);
+		if ((s & 1) && (s >> 1) != e)
+			return false;
+	}
+	__sync_bool_compare_and_swap(&dom->epoch, e, e + 1);
+	return true;
+}
+
+/* Hand a whole limbo list to the free functions */
+static inline void ebr_free_limbo(struct ebr_thread *t, struct ebr_limbo *l)
+{
+	int i;
+
+	for (i = 0; i < l->count; i++)
+		l->items[i].fn(l->items[i].arg, l->items[i].ptr);
+	__atomic_fetch_sub(&t->pending, l->count, __ATOMIC_RELAXED);
+	l->count = 0;
+}
+
+/* Free every limbo list of t whose grace period has passed */
+static inline void ebr_reclaim(struct ebr_thread *t)
+{
+	uint64_t e = __atomic_load_n(&t->dom->epoch, __ATOMIC_ACQUIRE);
+	int b;
+
+	for (b = 0; b < 3; b++)
+		if (t->limbo[b].count && t->limbo[b].epoch + 2 <= e)
+			ebr_free_limbo(t, &t->limbo[b]);
+}
+
+/*
+ * Announce a quiescent state: the calling thread holds no references into
+ * the domain's structures.  Also frees t's limbo lists whose grace period
+ * has passed.  A no-op for EBR.
+ */
+static inline void ebr_quiescent(struct ebr_thread *t)
+{
+	uint64_t e;
+
+	if (t->dom->mode != EBR_QSBR)
+		return;
+
+	e = __atomic_load_n(&t->dom->epoch, __ATOMIC_ACQUIRE);
+
+	/* The release keeps our earlier reads before the announcement */
+	__atomic_store_n(&t->state, e << 1 | 1, __ATOMIC_RELEASE);
+
+	if (t->pending)
+		ebr_reclaim(t);
+}
+
+/*
+ * Stop taking part in QSBR (e.g. before blocking for a long time), and
+ * free whatever of t's limbo that lets us.  The thread must not touch the
+ * domain's structures until it calls <ebr_quiescent> again.
+ */
+static inline void ebr_thread_offline(struct ebr_thread *t)
+{
+	__atomic_store_n(&t->state, 0, __ATOMIC_RELEASE);
+
+	/* We may be what held the epoch back */
+	if (t->pending) {
+		ebr_try_advance(t->dom);
+		ebr_reclaim(t);
+	}
+}
+
+/*
+ * Get a thread record for the calling thread.  Returns NULL if
+ * EBR_MAX_THREADS records are already in use.  In QSBR mode the thread
+ * starts out online.
+ */
+static inline struct ebr_thread *ebr_thread_acquire(struct ebr_domain *dom)
+{
+	struct ebr_thread *t;
+	int i;
+
+	for (i = 0; i < EBR_MAX_THREADS; i++) {
+		t = &dom->threads[i];
+		if (__atomic_load_n(&t->in_use, __ATOMIC_RELAXED))
+			continue;
+		if (!__sync_bool_compare_and_swap(&t->in_use, 0, 1))
+			continue;
+		ebr_quiescent(t);
+		return t;
+	}
+	return NULL;
+}
+
+/* Start a read side critical section.  A no-op for QSBR. */
+static inline void ebr_enter(struct ebr_thread *t)
+{
+	uint64_t e;
+
+	if (t->dom->mode == EBR_QSBR)
+		return;
+
+	/* The announcement has to be visible before we read any shared
+	 * pointer, so it needs a full fence (xchg on x86.)
+	 */
+	e = __atomic_load_n(&t->dom->epoch, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&t->state, e << 1 | 1, __ATOMIC_SEQ_CST);
+}
+
+/* End a read side critical section.  A no-op for QSBR. */
+static inline void ebr_exit(struct ebr_thread *t)
+{
+	if (t->dom->mode == EBR_QSBR)
+		return;
+
+	__atomic_store_n(&t->state, t->state & ~1UL, __ATOMIC_RELEASE);
+}
+
+/* Make room for more entries in l.  Returns false if out of memory. */
+static inline bool ebr_limbo_grow(struct ebr_limbo *l)
+{
+	int cap = l->cap ? 2 * l->cap : EBR_BATCH;
+	struct ebr_retired *items = realloc(l->items, cap * sizeof(*items));
+
+	if (items == NULL)
+		return false;
+	l->items = items;
+	l->cap = cap;
+	return true;
+}
+
+/*
+ * Hand ptr to fn(arg, ptr) once no thread can hold a reference to it.
+ * ptr must already be unreachable from the shared structure.
+ *
+ * Returns false if there was no memory to put ptr in limbo, even after
+ * freeing whatever could be.  ptr is then never freed, since nothing
+ * short of waiting out a grace period (which the caller itself may be
+ * holding up) makes that safe.
+ */
+static inline bool ebr_retire(struct ebr_thread *t,
+			      void *ptr,
+			      void (*fn)(void *arg, void *ptr),
+			      void *arg)
+{
+	uint64_t e = __atomic_load_n(&t->dom->epoch, __ATOMIC_ACQUIRE);
+	struct ebr_limbo *l = &t->limbo[e % 3];
+
+	/* The list for e % 3 last held epoch e - 3 or older, which is
+	 * past its grace period
+	 */
+	if (l->epoch != e) {
+		ebr_free_limbo(t, l);
+		l->epoch = e;
+	}
+
+	if (l->count == l->cap && !ebr_limbo_grow(l)) {
+		/* Free what we can, which may give realloc() room */
+		ebr_try_advance(t->dom);
+		ebr_reclaim(t);
+		if (!ebr_limbo_grow(l))
+			return false;
+	}
+	l->items[l->count].ptr = ptr;
+	l->items[l->count].fn = fn;
+	l->items[l->count].arg = arg;
+	l->count++;
+	__atomic_fetch_add(&t->pending, 1, __ATOMIC_RELAXED);
+
+	if (l->count % EBR_BATCH == 0) {
+		ebr_try_advance(t->dom);
+		ebr_reclaim(t);
+	}
+	return true;
+}
+
+/* Number of entries t has retired that are not freed yet */
+static inline int ebr_pending(const struct ebr_thread *t)
+{
+	return __atomic_load_n(&t->pending, __ATOMIC_RELAXED);
+}
+
+/* Number of entries retired in the domain that are not freed yet */
+static inline long ebr_domain_pending(const struct ebr_domain *dom)
+{
+	long n = 0;
+	int i;
+
+	for (i = 0; i < EBR_MAX_THREADS; i++)
+		n += ebr_pending(&dom->threads[i]);
+	return n;
+}
+
+/*
+ * Give up a thread record.  Whatever can't be freed yet stays in the
+ * record and is picked up by its next owner or <ebr_domain_drain>.
+ */
+static inline void ebr_thread_release(struct ebr_thread *t)
+{
+	__atomic_store_n(&t->state, 0, __ATOMIC_RELEASE);
+	ebr_try_advance(t->dom);
+	ebr_reclaim(t);
+	__atomic_store_n(&t->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Free everything retired in the domain, and the limbo lists themselves.
+ * No thread may be using any structure in the domain when this is
+ * called.
+ */
+static inline void ebr_domain_drain(struct ebr_domain *dom)
+{
+	struct ebr_thread *t;
+	int i, b;
+
+	for (i = 0; i < EBR_MAX_THREADS; i++) {
+		t = &dom->threads[i];
+		for (b = 0; b < 3; b++) {
+			ebr_free_limbo(t, &t->limbo[b]);
+			free(t->limbo[b].items);
+			t->limbo[b].items = NULL;
+			t->limbo[b].cap = 0;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef __FUTEX_H__
+#define __FUTEX_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/*****************************************************************************
+ * Thin wrappers around the Linux futex(2) system call.
+ *
+ * These use the shared (non-PRIVATE) futex operations so that waiters and
+ * wakers may live in different processes, as long as the futex word itself
+ * is in shared memory.  This matches the guarantees made by atomic_q.h.
+ ****************************************************************************/
+
+/*
+ * Sleep as long as *addr still contains val.  timeout is a relative time,
+ * or NULL to sleep forever.  Returns 0 when woken, or -1 with errno set
+ * (EAGAIN if *addr had already changed, ETIMEDOUT, EINTR.)
+ */
+static inline int futex_wait(uint32_t *addr,
+			     uint32_t val,
+			     const struct timespec *timeout)
+{
+	return syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+/*
+ * Wake up to nr threads sleeping on addr.  Returns the number woken.
+ */
+static inline int futex_wake(uint32_t *addr, int nr)
+{
+	return syscall(SYS_futex, addr, FUTEX_WAKE, nr, NULL, NULL, 0);
+}
+
+#endif
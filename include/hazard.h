@@ -0,0 +1,213 @@
+#ifndef __HAZARD_H__
+#define __HAZARD_H__
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "ccas.h"
+
+/*****************************************************************************
+ * Hazard pointer memory reclamation, as described in "Hazard Pointers: Safe
+ * Memory Reclamation for Lock-Free Objects" by Maged Michael, IEEE TPDS
+ * 2004.
+ *
+ * atomic_q.h and atomic_stack.h normally READ elements that may already have
+ * been freed, so freed elements have to stay mapped (e.g. in a pool).  With
+ * hazard pointers, a thread publishes the pointer it is about to
+ * dereference in one of its hazard slots, and memory is handed back to
+ * its free function only once no hazard slot points at it.  Elements can
+ * then be returned to malloc() or the OS.
+ *
+ * Threads using structures in a domain each acquire a struct hp_thread
+ * with <hp_thread_acquire> and pass it to the _hp variants of the queue and
+ * stack operations.  Retired memory collects in a per-thread list and is
+ * freed in batches by <hp_scan> when the list fills up.
+ ****************************************************************************/
+
+/* Maximum number of threads in a domain at the same time */
+#ifndef HP_MAX_THREADS
+#define HP_MAX_THREADS (64)
+#endif
+
+/* Hazard slots per thread */
+#define HP_PER_THREAD (2)
+
+/* Retired entries per thread.  Keeping this at twice the number of hazard
+ * slots in the domain guarantees that each scan frees at least half.
+ */
+#define HP_RETIRE_MAX (2 * HP_MAX_THREADS * HP_PER_THREAD)
+
+struct hp_retired {
+	void *ptr;
+	void (*fn)(void *arg, void *ptr);
+	void *arg;
+};
+
+/* Per-thread record.  Only the hazard slots are read by other threads. */
+struct hp_thread {
+	void *hazard[HP_PER_THREAD];
+	struct hp_domain *dom;
+	int in_use;
+	int nretired;
+	struct hp_retired retired[HP_RETIRE_MAX];
+} __attribute__((aligned(64)));
+
+/* A set of threads and the structures they share. */
+struct hp_domain {
+	struct hp_thread threads[HP_MAX_THREADS];
+};
+
+/* Initialize a domain. */
+static inline void hp_domain_init(struct hp_domain *dom)
+{
+	int i, j;
+
+	for (i = 0; i < HP_MAX_THREADS; i++) {
+		for (j = 0; j < HP_PER_THREAD; j++)
+			dom->threads[i].hazard[j] = NULL;
+		dom->threads[i].dom = dom;
+		dom->threads[i].in_use = 0;
+		dom->threads[i].nretired = 0;
+	}
+}
+
+/*
+ * Get a thread record for the calling thread.  Returns NULL if
+ * HP_MAX_THREADS records are already in use.
+ */
+static inline struct hp_thread *hp_thread_acquire(struct hp_domain *dom)
+{
+	int i;
+
+	for (i = 0; i < HP_MAX_THREADS; i++) {
+		if (__atomic_load_n(&dom->threads[i].in_use, __ATOMIC_RELAXED))
+			continue;
+		if (__sync_bool_compare_and_swap(&dom->threads[i].in_use, 0, 1))
+			return &dom->threads[i];
+	}
+	return NULL;
+}
+
+/*
+ * Publish a hazard on the pointer in *src, and return the counted pointer
+ * it was read from.  On return the pointer can't be freed until
+ * <hp_clear> is called on slot.
+ */
+static inline struct counted_ptr hp_protect(struct hp_thread *t,
+					    int slot,
+					    const struct counted_ptr *src)
+{
+	struct counted_ptr cp;
+
+	do {
+		cp = counted_load(src);
+		/* The store has to be visible before we re-read src, so it
+		 * needs a full fence (xchg on x86.)
+		 */
+		__atomic_store_n(&t->hazard[slot], counted_get_ptr(cp),
+				 __ATOMIC_SEQ_CST);
+	} while (counted_load_ptr(src) != counted_get_ptr(cp));
+
+	return cp;
+}
+
+/* Drop the hazard in slot */
+static inline void hp_clear(struct hp_thread *t, int slot)
+{
+	__atomic_store_n(&t->hazard[slot], NULL, __ATOMIC_RELEASE);
+}
+
+static inline int hp_cmp(const void *a, const void *b)
+{
+	const char *pa = *(const char * const *)a;
+	const char *pb = *(const char * const *)b;
+
+	return (pa > pb) - (pa < pb);
+}
+
+/*
+ * Free every retired entry of t that no thread holds a hazard on.
+ */
+static inline void hp_scan(struct hp_thread *t)
+{
+	struct hp_domain *dom = t->dom;
+	void *haz[HP_MAX_THREADS * HP_PER_THREAD];
+	int nhaz = 0, kept = 0, i, j;
+	void *p;
+
+	/* Order the unlinking of our retired entries before reading the
+	 * hazards (pairs with the fence in <hp_protect>)
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (i = 0; i < HP_MAX_THREADS; i++) {
+		for (j = 0; j < HP_PER_THREAD; j++) {
+			p = __atomic_load_n(&dom->threads[i].hazard[j],
+					    __ATOMIC_ACQUIRE);
+			if (p != NULL)
+				haz[nhaz++] = p;
+		}
+	}
+	qsort(haz, nhaz, sizeof(haz[0]), hp_cmp);
+
+	for (i = 0; i < t->nretired; i++) {
+		p = t->retired[i].ptr;
+		if (bsearch(&p, haz, nhaz, sizeof(haz[0]), hp_cmp) != NULL)
+			t->retired[kept++] = t->retired[i];
+		else
+			t->retired[i].fn(t->retired[i].arg, p);
+	}
+	t->nretired = kept;
+}
+
+/*
+ * Hand ptr to fn(arg, ptr) once no thread in the domain holds a hazard
+ * on it.  ptr must already be unreachable from the shared structure.
+ */
+static inline void hp_retire(struct hp_thread *t,
+			     void *ptr,
+			     void (*fn)(void *arg, void *ptr),
+			     void *arg)
+{
+	t->retired[t->nretired].ptr = ptr;
+	t->retired[t->nretired].fn = fn;
+	t->retired[t->nretired].arg = arg;
+	if (++t->nretired == HP_RETIRE_MAX) {
+		hp_scan(t);
+		assert(t->nretired < HP_RETIRE_MAX);
+	}
+}
+
+/*
+ * Give up a thread record.  Whatever can't be freed yet stays in the
+ * record and is picked up by its next owner or <hp_domain_drain>.
+ */
+static inline void hp_thread_release(struct hp_thread *t)
+{
+	int j;
+
+	for (j = 0; j < HP_PER_THREAD; j++)
+		hp_clear(t, j);
+	hp_scan(t);
+	__atomic_store_n(&t->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Free everything retired in the domain, hazards or not.  No thread may be
+ * using any structure in the domain when this is called.
+ */
+static inline void hp_domain_drain(struct hp_domain *dom)
+{
+	struct hp_thread *t;
+	int i, j;
+
+	for (i = 0; i < HP_MAX_THREADS; i++) {
+		t = &dom->threads[i];
+		for (j = 0; j < t->nretired; j++)
+			t->retired[j].fn(t->retired[j].arg, t->retired[j].ptr);
+		t->nretired = 0;
+	}
+}
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef __MPSC_Q_H__
+#define __MPSC_Q_H__
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "atomic_q.h"
+
+/*****************************************************************************
+ * This header file implements an intrusive FIFO queue for many enqueuing
+ * threads and exactly ONE dequeuing thread, e.g. a per-worker inbox.  It
+ * is the algorithm described by Dmitry Vyukov in "Intrusive MPSC node-based
+ * queue" (http://www.1024cores.net/home/lock-free-algorithms/queues/
+ * intrusive-mpsc-node-based-queue)
+ *
+ * Enqueue is a single atomic exchange on the tail followed by a store to
+ * link the previous element, whatever the contention.  Dequeue is
+ * wait-free: it never loops or retries.  There are no counted pointers
+ * and no 16 byte compare and swap.
+ *
+ * Elements use the same struct atomic_el as atomic_q.h (only the pointer
+ * half is used.)  Unlike struct atomic_q, the queue is completely done
+ * with an element once <mpsc_dequeue> returns it, so there is no freeer
+ * and no <aq_el_free>; the consumer owns the element.
+ *
+ * The one nuance: between a producer's exchange and its link store the
+ * queue is briefly "broken", and elements enqueued after that point are
+ * not visible yet.  <mpsc_dequeue> returns NULL in that window even though
+ * <mpsc_empty> may say otherwise, and the consumer simply tries again.
+ ****************************************************************************/
+
+/*****************************************************************************
+ ************************** EXTERNAL INTERFACES ******************************
+ *****************************************************************************/
+
+struct mpsc_q;
+
+/* Initialize a queue.  It needs to be COUNTED_ALIGN byte aligned. */
+static inline void
+mpsc_init(struct mpsc_q *q);
+
+/* Enqueue an element.  Any thread. */
+static inline void
+mpsc_enqueue(struct mpsc_q *q, struct atomic_el *el);
+
+/*
+ * Enqueue a NULL terminated, pre-linked chain of elements with a single
+ * exchange.  Any thread.
+ */
+static inline void
+mpsc_enqueue_multi(struct mpsc_q *q, struct atomic_el *el);
+
+/*
+ * Dequeue an element, or NULL if none is available.  Consumer thread
+ * only.
+ */
+static inline struct atomic_el *
+mpsc_dequeue(struct mpsc_q *q);
+
+/* Check if a queue is empty.  Any thread. */
+static inline bool
+mpsc_empty(const struct mpsc_q *q);
+
+/*****************************************************************************
+ ************************** INTERNAL INTERFACES ******************************
+ *****************************************************************************/
+
+/*
+ * The queue.  head is private to the consumer, tail is where producers
+ * exchange in new elements.  stub stands in for an element whenever the
+ * queue would otherwise be empty.
+ */
+struct mpsc_q {
+	struct atomic_el *head;
+	char _pad1[56];
+	struct atomic_el *tail;
+	char _pad2[56];
+	struct atomic_el stub;
+};
+
+static inline void
+mpsc_init(struct mpsc_q *q)
+{
+	assert(((unsigned long)q & (COUNTED_ALIGN - 1)) == 0);
+
+	counted_set(&q->stub.next, NULL, 0, false);
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+/* Link the chain first..last in at the tail. */
+static inline void
+mpsc_push(struct mpsc_q *q, struct atomic_el *first, struct atomic_el *last)
+{
+	struct atomic_el *prev;
+
+	counted_set_ptr(&last->next, NULL);
+
+	/* The exchange orders our writes to the chain before anybody can
+	 * find it through the tail...
+	 */
+	prev = __atomic_exchange_n(&q->tail, last, __ATOMIC_ACQ_REL);
+
+	/* ...and this store is what makes it reachable from the head */
+	counted_link(&prev->next, first);
+}
+
+static inline void
+mpsc_enqueue(struct mpsc_q *q, struct atomic_el *el)
+{
+	mpsc_push(q, el, el);
+}
+
+static inline void
+mpsc_enqueue_multi(struct mpsc_q *q, struct atomic_el *el)
+{
+	struct atomic_el *last_el = el;
+
+	/* Get the last element in the chain of elements we're adding */
+	while (counted_get_ptr(last_el->next) != NULL) {
+		assert(last_el != counted_get_ptr(last_el->next));
+		last_el = counted_get_ptr(last_el->next);
+	}
+	mpsc_push(q, el, last_el);
+}
+
+static inline bool
+mpsc_empty(const struct mpsc_q *q)
+{
+	return (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == &q->stub &&
+		counted_load_ptr(&q->stub.next) == NULL);
+}
+
+static inline struct atomic_el *
+mpsc_dequeue(struct mpsc_q *q)
+{
+	struct atomic_el *head = q->head;
+	struct atomic_el *next;
+
+	next = counted_load_ptr(&head->next);
+
+	/* Skip over the stub if it is at the front */
+	if (head == &q->stub) {
+		if (next == NULL)
+			return NULL;
+		q->head = next;
+		head = next;
+		next = counted_load_ptr(&head->next);
+	}
+
+	/* Easy case, head is not the last element */
+	if (next != NULL) {
+		q->head = next;
+		return head;
+	}
+
+	/* head looks like the last element.  If the tail says otherwise a
+	 * producer is between its exchange and its link store, and we
+	 * can't get past head until it finishes.
+	 */
+	if (head != __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	/* head really is the last element.  Put the stub back behind it so
+	 * we can take head without leaving the queue without an element.
+	 */
+	mpsc_push(q, &q->stub, &q->stub);
+
+	next = counted_load_ptr(&head->next);
+	if (next != NULL) {
+		q->head = next;
+		return head;
+	}
+
+	/* A producer got in ahead of the stub and has not linked yet */
+	return NULL;
+}
+
+#endif
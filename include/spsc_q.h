@@ -0,0 +1,258 @@
+#ifndef __SPSC_Q_H__
+#define __SPSC_Q_H__
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "atomic_q.h"
+
+/*****************************************************************************
+ * This header file implements FIFO queues for exactly ONE enqueuing thread
+ * and ONE dequeuing thread.  With only one thread on each end nobody ever
+ * races for the same position, so there is no compare and swap and no
+ * locked instruction anywhere: just loads and stores with acquire/release
+ * ordering.  (Except with CCAS_TAGGED, where the link and the reference
+ * count of an element share one word and have to be updated atomically.)
+ *
+ * Two flavors are provided:
+ *
+ * struct spsc_q is intrusive and uses the same struct atomic_el and
+ * freeer conventions as atomic_q.h, so elements can move between the two.
+ * Like struct atomic_q it keeps a dummy element at the head, which means
+ * an element is still in use by the queue after <spsc_dequeue> returns
+ * it.  Release elements with <spsc_el_free>, never by calling the freeer
+ * directly.  Because the reference count is not atomic here,
+ * <spsc_el_free> must be called from the consumer thread.
+ *
+ * struct spsc_ring is a bounded array of pointers, like atomic_ring.h.
+ * Each side keeps a private copy of the other side's index and only
+ * re-reads the shared one when the copy says the ring is full (producer)
+ * or empty (consumer), so in steady state neither side reads the other's
+ * cache line.  Allocate spsc_ring_size(capacity) bytes, 64 byte aligned.
+ ****************************************************************************/
+
+/*****************************************************************************
+ ************************** EXTERNAL INTERFACES ******************************
+ *****************************************************************************/
+
+struct spsc_q;
+struct spsc_ring;
+
+/*
+ * Initialize a queue.  dummyel, freeer and freeer_arg are as for
+ * <aq_init>.
+ */
+static inline void
+spsc_init(struct spsc_q *q,
+	  struct atomic_el *dummyel,
+	  void (*freeer)(void *arg, struct atomic_el *),
+	  void *freeer_arg);
+
+/*
+ * Free a queue and all elements on it.  Neither the producer nor the
+ * consumer may still be using it.
+ */
+static inline void
+spsc_free(struct spsc_q *q);
+
+/* Enqueue an element.  Producer thread only. */
+static inline void
+spsc_enqueue(struct spsc_q *q, struct atomic_el *el);
+
+/* Dequeue an element, or NULL if the queue is empty.  Consumer only. */
+static inline struct atomic_el *
+spsc_dequeue(struct spsc_q *q);
+
+/* Check if a queue is empty.  Consumer only. */
+static inline bool
+spsc_empty(const struct spsc_q *q);
+
+/*
+ * Release a dequeued element.  Consumer thread only.  Elements must have
+ * been set up with <aq_el_init>.
+ */
+static inline void
+spsc_el_free(struct spsc_q *q, struct atomic_el *el);
+
+/* Bytes needed for a ring with capacity slots */
+#define spsc_ring_size(capacity) \
+	(sizeof(struct spsc_ring) + (capacity) * sizeof(void *))
+
+/* Initialize a ring.  capacity must be a power of two. */
+static inline void
+spsc_ring_init(struct spsc_ring *r, uint64_t capacity);
+
+/*
+ * Add data (not NULL) to the ring.  Returns false if the ring is full.
+ * Producer thread only.
+ */
+static inline bool
+spsc_ring_try_enqueue(struct spsc_ring *r, void *data);
+
+/*
+ * Remove the oldest element, or return NULL if the ring is empty.
+ * Consumer thread only.
+ */
+static inline void *
+spsc_ring_try_dequeue(struct spsc_ring *r);
+
+/*****************************************************************************
+ ************************** INTERNAL INTERFACES ******************************
+ *****************************************************************************/
+
+/*
+ * The intrusive queue.  head is only touched by the consumer, tail only by
+ * the producer.  They meet through the next pointers of the elements.
+ */
+struct spsc_q {
+	struct atomic_el *head;
+	void (*freeer)(void *, struct atomic_el *);
+	void *freeer_arg;
+	char _pad1[40];
+	struct atomic_el *tail;
+	char _pad2[56];
+};
+
+/*
+ * The ring.  mask is read-only after init.  Each side's line holds its
+ * own index and its cached copy of the other side's.
+ */
+struct spsc_ring {
+	uint64_t mask;
+	char _pad1[56];
+	uint64_t tail;		/* producer: next slot to fill */
+	uint64_t head_cache;	/* producer: last head it saw */
+	char _pad2[48];
+	uint64_t head;		/* consumer: next slot to empty */
+	uint64_t tail_cache;	/* consumer: last tail it saw */
+	char _pad3[48];
+	void *slots[];
+};
+
+static inline void
+spsc_init(struct spsc_q *q,
+	  struct atomic_el *dummyel,
+	  void (*freeer)(void *, struct atomic_el *),
+	  void *freeer_arg)
+{
+	/* the dummy never is never returned from dequeue, so preset the
+	   "refcount" to only need a single toggle */
+	counted_set(&dummyel->next, NULL, 0, true);
+
+	q->head = dummyel;
+	q->tail = dummyel;
+	q->freeer = freeer;
+	q->freeer_arg = freeer_arg;
+}
+
+static inline void
+spsc_el_free(struct spsc_q *q, struct atomic_el *el)
+{
+	/* Same two-toggle reference as <aq_el_free>, but only the
+	 * consumer thread ever touches it, so no atomic is needed
+	 * (unless it shares a word with the link.)
+	 */
+	if (counted_toggle_flag_excl(&el->next))
+		q->freeer(q->freeer_arg, el);
+}
+
+static inline void
+spsc_free(struct spsc_q *q)
+{
+	struct atomic_el *el, *next;
+
+	for (el = q->head; el != NULL; el = next) {
+		next = counted_get_ptr(el->next);
+		q->freeer(q->freeer_arg, el);
+	}
+	q->head = q->tail = NULL;
+	q->freeer = NULL;
+}
+
+static inline void
+spsc_enqueue(struct spsc_q *q, struct atomic_el *el)
+{
+	struct atomic_el *prev = q->tail;
+
+	counted_set_ptr(&el->next, NULL);
+	q->tail = el;
+
+	/* Publish.  The release orders the caller's writes to the element
+	 * (and the NULL above) before the consumer can see it.
+	 */
+	counted_link(&prev->next, el);
+}
+
+static inline bool
+spsc_empty(const struct spsc_q *q)
+{
+	return counted_load_ptr(&q->head->next) == NULL;
+}
+
+static inline struct atomic_el *
+spsc_dequeue(struct spsc_q *q)
+{
+	struct atomic_el *head = q->head;
+	struct atomic_el *next;
+
+	next = counted_load_ptr(&head->next);
+	if (next == NULL)
+		return NULL;
+
+	/* next becomes the dummy, release the old one */
+	q->head = next;
+	spsc_el_free(q, head);
+
+	return next;
+}
+
+static inline void
+spsc_ring_init(struct spsc_ring *r, uint64_t capacity)
+{
+	/* capacity must be a power of two */
+	assert(capacity >= 2 && (capacity & (capacity - 1)) == 0);
+
+	r->mask = capacity - 1;
+	r->tail = r->head_cache = 0;
+	r->head = r->tail_cache = 0;
+}
+
+static inline bool
+spsc_ring_try_enqueue(struct spsc_ring *r, void *data)
+{
+	uint64_t tail = r->tail;
+
+	assert(data != NULL);
+
+	if (tail - r->head_cache > r->mask) {
+		/* Looks full, see how far the consumer really got */
+		r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (tail - r->head_cache > r->mask)
+			return false;
+	}
+
+	r->slots[tail & r->mask] = data;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static inline void *
+spsc_ring_try_dequeue(struct spsc_ring *r)
+{
+	uint64_t head = r->head;
+	void *data;
+
+	if (head == r->tail_cache) {
+		/* Looks empty, see how far the producer really got */
+		r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (head == r->tail_cache)
+			return NULL;
+	}
+
+	data = r->slots[head & r->mask];
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return data;
+}
+
+#endif
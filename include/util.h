@@ -14,5 +14,17 @@
 	const typeof( ((type *)0)->member ) *__mptr = (ptr);	\
 	(type *)( (char *)__mptr - offsetof(type,member) );})
 
+/**
+ * Function: cpu_relax
+ *
+ * Hint to the CPU that we are in a spin-wait loop (the x86 PAUSE
+ * instruction.)  This saves power and avoids the memory order
+ * mis-speculation penalty when the loop exits.
+ */
+static inline void cpu_relax(void)
+{
+	__builtin_ia32_pause();
+}
+
 
 #endif
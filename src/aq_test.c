@@ -14,6 +14,9 @@
  * In the main routine, update "repeat" if you want to run a more torturous
  * test (i.e. repeat a number of times.)
  *
+ * Receivers wait in aq_dequeue_spinwait() while the queue is empty, and
+ * senders use the same adaptive waiter while the queue is over CAPACITY.
+ *
  * The test validates that the correct number of messages is sent and
  * received.  Each message is given a numeric ID.  When it is sent, the
  * corresponding bit is turned on in a bit map, when it is received, we
@@ -109,6 +112,9 @@ static int cur_enqueued;
 static void *sender(void *arg) {
         struct atomic_q *mb = (struct atomic_q *)arg;
 	struct mymsg *msg;
+	struct aq_waiter w;
+
+	aq_waiter_init(&w, AQ_WAIT_ADAPTIVE);
 
         for (;;) {
 		if (__sync_fetch_and_add(&msgs_sent, 1) >= NMSG) {
@@ -118,9 +124,11 @@ static void *sender(void *arg) {
 
 		cur_enqueued = aq_queued(mb);
 		while (cur_enqueued > CAPACITY) {
-                        sched_yield();
+			if (aq_wait_spin(&w))
+				aq_wait_park(&w);
 			cur_enqueued = aq_queued(mb);
 		}
+		aq_wait_done(&w);
 
                 msg = get_msg();
 		msg->payload = msg - msgs;
@@ -134,13 +142,14 @@ static void *sender(void *arg) {
 static void *receiver(void *arg) {
         struct atomic_q *mb = (struct atomic_q *)arg;
         struct mymsg *msg;
+	struct aq_waiter w;
+
+	aq_waiter_init(&w, AQ_WAIT_ADAPTIVE);
 
         for (;;) {
-                while ((msg = container_of(aq_dequeue(mb),
+                msg = container_of(aq_dequeue_spinwait(mb, AQ_BLOCK, &w),
 				   struct mymsg,
-				   amsg)) == NULL) {
-                        sched_yield();
-                }
+				   amsg);
                 if (msg->payload == SHUTDOWN) {
 			aq_el_free(mb, &msg->amsg);
 			return NULL;
@@ -156,12 +165,48 @@ static void *receiver(void *arg) {
         }
 }
 
+/*
+ * Single threaded check of aq_dequeue_multi().  The queue must be empty
+ * on entry, and is empty again on return.
+ */
+static void test_dequeue_multi(struct atomic_q *mb)
+{
+	struct mymsg *sent[10];
+	struct atomic_el *got[10];
+	int i, n;
+
+	for (i = 0; i < 10; i++) {
+		sent[i] = get_msg();
+		aq_enqueue(mb, &sent[i]->amsg);
+	}
+
+	n = aq_dequeue_multi(mb, 4, got);
+	if (n != 4 || aq_queued(mb) != 6)
+		printf("ERROR: Batch dequeue got %d, %ld left\n",
+		       n, aq_queued(mb));
+
+	n += aq_dequeue_multi(mb, 10 - n, got + n);
+	if (n != 10 || !aq_empty(mb) || aq_queued(mb) != 0)
+		printf("ERROR: Batch dequeue got %d, %ld left\n",
+		       n, aq_queued(mb));
+
+	if (aq_dequeue_multi(mb, 10, got) != 0)
+		printf("ERROR: Batch dequeue of empty queue\n");
+
+	for (i = 0; i < n; i++) {
+		if (got[i] != &sent[i]->amsg)
+			printf("ERROR: Batch dequeue out of order\n");
+		aq_el_free(mb, got[i]);
+	}
+}
+
 int main(int argc, char **argv)
 {
         pthread_t stid[NUM_SENDERS], rtid[NUM_RECEIVERS];
         struct atomic_q mb;
         int i, j;
         int repeat = 1; /* bump this number for more torturing */
+	struct timespec timeout = { 0, 1000000 };
 
         for (j=0; j < repeat; j++) {
 
@@ -214,6 +259,13 @@ int main(int argc, char **argv)
                         printf("ERROR: Final queue not empty!\n");
                 }
 
+		/* A timed dequeue on the empty queue must give up */
+		if (aq_dequeue_wait(&mb, &timeout) != NULL) {
+                        printf("ERROR: Timed dequeue returned a message!\n");
+		}
+
+		test_dequeue_multi(&mb);
+
 		aq_free(&mb);
 
 		/* Make sure we sent/received the right number of messages */
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "atomic_ring.h"
+#include "aq_wait.h"
+/*****************************************************************************
+ * Unit tests for the bounded atomic ring.  This sends NMSG messages from
+ * N sender threads to M receiver threads through a ring of CAPACITY
+ * slots, so the ring is full much of the time and the senders have to
+ * back off when <ar_try_enqueue> fails.
+ *
+ * Messages are just numbers (offset by one, since NULL means empty.)  As
+ * in aq_test.c, a bit is set for each message sent and cleared when it is
+ * received, which detects duplicate or lost messages.
+ ****************************************************************************/
+
+#define NMSG (200000)
+#define SHUTDOWN (NMSG + 1)
+#define NUM_SENDERS (4)
+#define NUM_RECEIVERS (4)
+#define CAPACITY (64)
+
+static unsigned long map[(NMSG + 1) / (8 * sizeof(long)) + 1];
+
+static inline bool setbit(unsigned long *pmap, unsigned long bit)
+{
+        unsigned long idx = bit / (sizeof(long)*8);
+        unsigned long x = 1LU << (bit % (sizeof(long) * 8));
+
+        return ((__sync_fetch_and_or(pmap+idx, x) & x) != 0);
+}
+
+static inline bool clearbit(unsigned long *pmap, unsigned long bit)
+{
+        unsigned long idx = bit / (sizeof(long)*8);
+        unsigned long x = (1LU << (bit % (sizeof(long) * 8)));
+
+        return ((__sync_fetch_and_and(pmap+idx, ~x) & x) != 0);
+}
+
+static long msgs_sent;
+static long msgs_received;
+
+static void send(struct atomic_ring *r, struct aq_waiter *w, unsigned long m)
+{
+	while (!ar_try_enqueue(r, (void *)(m + 1))) {
+		if (aq_wait_spin(w))
+			aq_wait_park(w);
+	}
+	aq_wait_done(w);
+}
+
+static void *sender(void *arg)
+{
+	struct atomic_ring *r = (struct atomic_ring *)arg;
+	struct aq_waiter w;
+	long m;
+
+	aq_waiter_init(&w, AQ_WAIT_ADAPTIVE);
+
+	for (;;) {
+		m = __sync_fetch_and_add(&msgs_sent, 1);
+		if (m >= NMSG) {
+			__sync_fetch_and_sub(&msgs_sent, 1);
+			return NULL;
+		}
+
+		if (setbit(map, m))
+			printf("ERROR: Message %ld sent twice\n", m);
+		send(r, &w, m);
+	}
+}
+
+static void *receiver(void *arg)
+{
+	struct atomic_ring *r = (struct atomic_ring *)arg;
+	struct aq_waiter w;
+	unsigned long m;
+	void *data;
+
+	aq_waiter_init(&w, AQ_WAIT_ADAPTIVE);
+
+	for (;;) {
+		while ((data = ar_try_dequeue(r)) == NULL) {
+			if (aq_wait_spin(&w))
+				aq_wait_park(&w);
+		}
+		aq_wait_done(&w);
+
+		m = (unsigned long)data - 1;
+		if (m == SHUTDOWN)
+			return NULL;
+
+		if (!clearbit(map, m))
+			printf("ERROR: Received unexpected message %lu\n", m);
+		__sync_fetch_and_add(&msgs_received, 1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t stid[NUM_SENDERS], rtid[NUM_RECEIVERS];
+	struct atomic_ring *r;
+	struct aq_waiter w;
+	unsigned long i;
+
+	r = aligned_alloc(64, ar_size(CAPACITY));
+	ar_init(r, CAPACITY);
+	aq_waiter_init(&w, AQ_WAIT_ADAPTIVE);
+
+	/* Exact capacity: the ring takes CAPACITY elements and no more */
+	for (i = 0; i < CAPACITY; i++)
+		if (!ar_try_enqueue(r, (void *)(i + 1)))
+			printf("ERROR: Ring full after %lu elements\n", i);
+	if (ar_try_enqueue(r, (void *)1))
+		printf("ERROR: Enqueue to full ring succeeded\n");
+	if (ar_queued(r) != CAPACITY)
+		printf("ERROR: Full ring holds %lu\n", ar_queued(r));
+	for (i = 0; i < CAPACITY; i++)
+		if (ar_try_dequeue(r) != (void *)(i + 1))
+			printf("ERROR: Ring out of order at %lu\n", i);
+	if (ar_try_dequeue(r) != NULL || ar_queued(r) != 0)
+		printf("ERROR: Drained ring not empty\n");
+
+	for (i = 0; i < NUM_SENDERS; i++)
+		pthread_create(&stid[i], NULL, sender, r);
+	for (i = 0; i < NUM_RECEIVERS; i++)
+		pthread_create(&rtid[i], NULL, receiver, r);
+
+	for (i = 0; i < NUM_SENDERS; i++)
+		pthread_join(stid[i], NULL);
+	for (i = 0; i < NUM_RECEIVERS; i++)
+		send(r, &w, SHUTDOWN);
+	for (i = 0; i < NUM_RECEIVERS; i++)
+		pthread_join(rtid[i], NULL);
+
+	if (ar_try_dequeue(r) != NULL)
+		printf("ERROR: Final ring not empty!\n");
+	if (msgs_sent != NMSG || msgs_received != NMSG)
+		printf("ERROR: Message counts wrong (%ld sent, %ld received)\n",
+		       msgs_sent, msgs_received);
+	for (i = 0; i < NMSG; i++)
+		if (map[i / (8 * sizeof(long))] & (1LU << (i % (8 * sizeof(long)))))
+			printf("ERROR: message %lu not received\n", i);
+
+	free(r);
+	printf("atomic_ring test: exchanged %ld messages\n", msgs_received);
+
+	return 0;
+}
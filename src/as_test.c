@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "atomic_stack.h"
+#include "util.h"
+/*****************************************************************************
+ * Unit tests for the bulk stack operations.  NUM_PUSHERS threads link
+ * their entries into chains of random length and push each chain with
+ * as_push_list().  NUM_POPPERS threads take the whole stack with
+ * as_pop_all() and hand every entry back to its owner.
+ *
+ * Every entry carries a flag saying whether it is on the stack, so an
+ * entry that shows up twice is caught, and at the end every entry must
+ * have been pushed and popped the same number of times.
+ ****************************************************************************/
+
+#define NITER (100000L)
+#define NUM_PUSHERS (4)
+#define NUM_POPPERS (2)
+#define PER_THREAD (64)
+
+struct myentry {
+	struct as_entry ase;
+	int on_stack;
+	int owner;
+};
+
+static struct as_head stack __attribute__((aligned(16)));
+static struct as_head returned[NUM_PUSHERS] __attribute__((aligned(16)));
+static struct myentry entries[NUM_PUSHERS][PER_THREAD];
+static long pushed, popped;
+static int pushers_done;
+
+static void *pusher(void *arg)
+{
+	long id = (long)arg;
+	struct as_entry *first, *last, *e;
+	unsigned int seed = id;
+	long i;
+	int j, n;
+
+	for (j = 0; j < PER_THREAD; j++) {
+		entries[id][j].owner = id;
+		as_push(&returned[id], &entries[id][j].ase);
+	}
+
+	for (i = 0; i < NITER; i++) {
+		n = rand_r(&seed) % 16 + 1;
+		first = last = NULL;
+		for (j = 0; j < n; j++) {
+			while ((e = as_pop(&returned[id])) == NULL)
+				sched_yield();
+			if (!__sync_bool_compare_and_swap(
+				    &container_of(e, struct myentry, ase)->on_stack,
+				    0, 1))
+				printf("ERROR: Pushed an entry twice\n");
+			e->next = first;
+			if (last == NULL)
+				last = e;
+			first = e;
+		}
+		as_push_list(&stack, first, last);
+		__sync_fetch_and_add(&pushed, n);
+	}
+	return NULL;
+}
+
+static void *popper(void *arg)
+{
+	struct as_entry *e, *next;
+	struct myentry *m;
+	bool done;
+
+	do {
+		done = __atomic_load_n(&pushers_done, __ATOMIC_ACQUIRE);
+		e = as_pop_all(&stack);
+		if (e == NULL)
+			sched_yield();
+		for (; e != NULL; e = next) {
+			next = e->next;
+			m = container_of(e, struct myentry, ase);
+			if (!__sync_bool_compare_and_swap(&m->on_stack, 1, 0))
+				printf("ERROR: Popped an entry twice\n");
+			__sync_fetch_and_add(&popped, 1);
+			as_push(&returned[m->owner], e);
+		}
+	} while (!done);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t ptid[NUM_PUSHERS], ctid[NUM_POPPERS];
+	struct as_entry *e;
+	long i;
+	int n;
+
+	as_init(&stack);
+	for (i = 0; i < NUM_PUSHERS; i++)
+		as_init(&returned[i]);
+
+	for (i = 0; i < NUM_PUSHERS; i++)
+		pthread_create(&ptid[i], NULL, pusher, (void *)i);
+	for (i = 0; i < NUM_POPPERS; i++)
+		pthread_create(&ctid[i], NULL, popper, NULL);
+	for (i = 0; i < NUM_PUSHERS; i++)
+		pthread_join(ptid[i], NULL);
+	__atomic_store_n(&pushers_done, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < NUM_POPPERS; i++)
+		pthread_join(ctid[i], NULL);
+
+	if (!as_empty(&stack))
+		printf("ERROR: Final stack not empty!\n");
+	if (pushed != popped)
+		printf("ERROR: Pushed %ld entries, popped %ld\n", pushed, popped);
+
+	/* Everybody should have all their entries back */
+	for (i = 0; i < NUM_PUSHERS; i++) {
+		n = 0;
+		for (e = as_pop_all(&returned[i]); e != NULL; e = e->next)
+			n++;
+		if (n != PER_THREAD)
+			printf("ERROR: Thread %ld got %d entries back\n", i, n);
+	}
+
+	printf("stack test: %ld entries in %ld chains\n", pushed,
+	       NITER * NUM_PUSHERS);
+
+	return 0;
+}
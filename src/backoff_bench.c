@@ -0,0 +1,113 @@
+/* The stack takes its policy at compile time.  Make that a variable here
+ * so one binary can try them all.
+ */
+static int stack_mode;
+#define AS_BACKOFF (stack_mode)
+
+#include "bench.h"
+#include "atomic_q.h"
+#include "atomic_stack.h"
+#include "util.h"
+/*****************************************************************************
+ * Benchmark for the backoff policies in backoff.h, on the bench.h harness.
+ * For each policy, from 1 thread up to one per CPU, it times:
+ *
+ * queue_<policy>   aq_enqueue() of an element followed by aq_dequeue() of
+ *                  one (not necessarily the same), on a shared struct
+ *                  atomic_q; each is an operation
+ * stack_<policy>   as_push() of the thread's node onto a shared struct
+ *                  as_head followed by as_pop() of one; each is an
+ *                  operation
+ *
+ * See bench.h for the options and output.  Threads are pinned one per
+ * CPU, so only go past the CPU count with -t on purpose: with more
+ * threads than CPUs they mostly get preempted rather than collide, and
+ * backoff only costs time.
+ ****************************************************************************/
+
+#define MAX_THREADS (256)
+
+struct bench_node {
+	struct as_entry ase;
+} __attribute__((aligned(16)));
+
+static const char *mode_names[] = {
+	"none", "exp", "random", "proportional",
+};
+
+static struct atomic_q queue __attribute__((aligned(64)));
+static struct as_head stack __attribute__((aligned(64)));
+static struct bench_node nodes[MAX_THREADS];
+static struct as_entry *stack_held[MAX_THREADS];
+
+static void queue_work(void *arg, int id, long n)
+{
+	struct atomic_el *el;
+
+	for (; n > 0; n -= 2) {
+		aq_enqueue(&queue, &bench_msg_get()->amsg);
+		el = aq_dequeue(&queue);
+		if (el != NULL)
+			aq_el_free(&queue, el);
+	}
+}
+
+static void stack_work(void *arg, int id, long n)
+{
+	struct as_entry *e = stack_held[id];
+
+	for (; n > 0; n -= 2) {
+		as_push(&stack, e);
+		/* Every thread pops after it pushes, so this never fails */
+		e = as_pop(&stack);
+	}
+	stack_held[id] = e;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_opts o;
+	struct bench_result r;
+	struct bench_msg *dummy;
+	char name[32];
+	int mode, t, i;
+
+	bench_parse_args(&o, argc, argv);
+	if (o.max_threads > MAX_THREADS)
+		o.max_threads = MAX_THREADS;
+
+	bench_begin(&o);
+	for (t = 1; t <= o.max_threads; t = bench_next_threads(t, &o)) {
+		for (mode = BACKOFF_NONE; mode <= BACKOFF_PROPORTIONAL;
+		     mode++) {
+			dummy = bench_msg_get();
+			aq_init(&queue, &dummy->amsg, bench_msg_free, NULL);
+			aq_set_backoff(&queue, mode);
+			snprintf(name, sizeof(name), "queue_%s",
+				 mode_names[mode]);
+			bench_measure(name, t, queue_work, NULL, &o, &r);
+			bench_print(&o, &r);
+			if (!aq_empty(&queue))
+				printf("ERROR: Queue not empty\n");
+			aq_free(&queue);
+		}
+
+		for (mode = BACKOFF_NONE; mode <= BACKOFF_PROPORTIONAL;
+		     mode++) {
+			as_init(&stack);
+			for (i = 0; i < t; i++)
+				stack_held[i] = &nodes[i].ase;
+			stack_mode = mode;
+			snprintf(name, sizeof(name), "stack_%s",
+				 mode_names[mode]);
+			bench_measure(name, t, stack_work, NULL, &o, &r);
+			bench_print(&o, &r);
+			if (!as_empty(&stack))
+				printf("ERROR: Stack not empty\n");
+		}
+	}
+	bench_end(&o);
+
+	bench_msg_free_all();
+	return 0;
+}
@@ -0,0 +1,918 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+/* For pthread_setaffinity_np() and the CPU_ macros.  Include this first. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "atomic_q.h"
+#include "atomic_stack.h"
+#include "util.h"
+
+#if !defined(BENCH_NO_PERF) && defined(__has_include)
+#if __has_include(<linux/perf_event.h>)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#define BENCH_HAVE_PERF
+#endif
+#endif
+
+/*****************************************************************************
+ * A small harness shared by the benchmarks in this directory.
+ *
+ * <bench_measure> runs a benchmark's work function on 1 or more threads,
+ * each pinned to its own CPU (see <bench_pin>.)  Every thread does
+ * opts.warmup untimed rounds and then opts.reps timed ones of opts.ops
+ * operations each, all threads starting each round together.  Inside a
+ * round, every BENCH_BATCH operations are timed as one sample, so the
+ * result has a distribution and not just an average: the median and 99th
+ * percentile of ns per operation over all samples of all threads, plus
+ * the total throughput.
+ *
+ * The work function does n operations for thread id:
+ *
+ * static void my_work(void *arg, int id, long n)
+ * {
+ *         while (n--)
+ *                 ...one operation...
+ * }
+ *
+ * and a benchmark's main() looks like:
+ *
+ * struct bench_opts o;
+ * struct bench_result r;
+ *
+ * bench_parse_args(&o, argc, argv);
+ * bench_begin(&o);
+ * for (t = 1; t <= o.max_threads; t = bench_next_threads(t, &o)) {
+ *         bench_measure("my_work", t, my_work, &state, &o, &r);
+ *         bench_print(&o, &r);
+ * }
+ * bench_end(&o);
+ *
+ * Results are CSV, or JSON with -j.  See <bench_usage> for the options.
+ * Where perf_event_open() is allowed, each thread also counts what its
+ * timed rounds cost in CPU events, reported per operation next to the
+ * times (see enum bench_counter.)
+ * Benchmarks with other results print them with <bench_print_row>, and
+ * can keep latency distributions in a struct bench_hist.  Queue elements
+ * come from <bench_msg_get>.
+ ****************************************************************************/
+
+/* Operations per timed sample */
+#ifndef BENCH_BATCH
+#define BENCH_BATCH (100)
+#endif
+
+struct bench_opts {
+	long ops;		/* operations per thread per round */
+	int reps;		/* timed rounds */
+	int warmup;		/* untimed rounds first */
+	int max_threads;	/* the most threads to scale to */
+	int json;		/* print JSON rather than CSV */
+	int printed;		/* results printed so far */
+};
+
+/*
+ * Events counted with perf_event_open() while the timed rounds run, in
+ * user space only for the hardware ones, so it works with
+ * perf_event_paranoid at 2.  Those are often missing in virtual machines;
+ * the software ones (context switches and CPU time) are always there on
+ * Linux.
+ *
+ * BENCH_HITM counts loads that hit a line modified in another core's
+ * cache, the cost of sharing a cache line that is written.  There is no
+ * generic event for it, so it is the raw event in the environment
+ * variable BENCH_HITM_EVENT, or by default on Intel
+ * MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM (0x04d2, Skylake and later.)
+ * Anything else can be counted in its place, with the same variable.
+ */
+enum bench_counter {
+	BENCH_CYCLES,
+	BENCH_INSTRUCTIONS,
+	BENCH_LLC_MISSES,
+	BENCH_HITM,
+	BENCH_CONTEXT_SWITCHES,
+	BENCH_CPU_NS,
+	BENCH_COUNTERS
+};
+
+static const char *const bench_counter_names[BENCH_COUNTERS] = {
+	[BENCH_CYCLES]		= "cycles_op",
+	[BENCH_INSTRUCTIONS]	= "instr_op",
+	[BENCH_LLC_MISSES]	= "llc_miss_op",
+	[BENCH_HITM]		= "hitm_op",
+	[BENCH_CONTEXT_SWITCHES] = "cs_op",
+	[BENCH_CPU_NS]		= "cpu_ns_op",
+};
+
+/* One thread's counters, -1 for those it couldn't open */
+struct bench_counters {
+	int fd[BENCH_COUNTERS];
+};
+
+#ifdef BENCH_HAVE_PERF
+
+/* The raw event for BENCH_HITM, or 0 for none */
+static inline uint64_t bench_hitm_event(void)
+{
+	const char *env = getenv("BENCH_HITM_EVENT");
+
+	if (env != NULL)
+		return strtoull(env, NULL, 0);
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_is("intel"))
+		return 0x04d2;
+#endif
+	return 0;
+}
+
+static inline int bench_counter_open(uint32_t type, uint64_t config)
+{
+	struct perf_event_attr attr;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_hv = 1;
+	/* So counts can be scaled if the PMU has to multiplex */
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+			   PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	/* Context switches happen in the kernel, so try counting there
+	 * first.  perf_event_paranoid 2 only lets us count user space.
+	 */
+	if (type == PERF_TYPE_SOFTWARE) {
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (fd >= 0)
+			return fd;
+	}
+	attr.exclude_kernel = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Open the calling thread's counters, disabled */
+static inline void bench_counters_open(struct bench_counters *c)
+{
+	uint64_t hitm = bench_hitm_event();
+
+	c->fd[BENCH_CYCLES] = bench_counter_open(PERF_TYPE_HARDWARE,
+					PERF_COUNT_HW_CPU_CYCLES);
+	c->fd[BENCH_INSTRUCTIONS] = bench_counter_open(PERF_TYPE_HARDWARE,
+					PERF_COUNT_HW_INSTRUCTIONS);
+	c->fd[BENCH_LLC_MISSES] = bench_counter_open(PERF_TYPE_HARDWARE,
+					PERF_COUNT_HW_CACHE_MISSES);
+	c->fd[BENCH_HITM] = hitm ? bench_counter_open(PERF_TYPE_RAW, hitm)
+				 : -1;
+	c->fd[BENCH_CONTEXT_SWITCHES] = bench_counter_open(
+		PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES);
+	c->fd[BENCH_CPU_NS] = bench_counter_open(PERF_TYPE_SOFTWARE,
+					PERF_COUNT_SW_TASK_CLOCK);
+}
+
+/* Start (on true) or stop counting */
+static inline void bench_counters_enable(struct bench_counters *c, bool on)
+{
+	int i;
+
+	for (i = 0; i < BENCH_COUNTERS; i++)
+		if (c->fd[i] >= 0)
+			ioctl(c->fd[i], on ? PERF_EVENT_IOC_ENABLE :
+			      PERF_EVENT_IOC_DISABLE, 0);
+}
+
+/*
+ * Close the counters, adding what they counted to count.  Sets missing[i]
+ * for those that weren't counted.
+ */
+static inline void bench_counters_close(struct bench_counters *c,
+					uint64_t *count, bool *missing)
+{
+	uint64_t v[3];	/* value, time enabled, time running */
+	int i;
+
+	for (i = 0; i < BENCH_COUNTERS; i++) {
+		if (c->fd[i] < 0 ||
+		    read(c->fd[i], v, sizeof(v)) != sizeof(v)) {
+			missing[i] = true;
+		} else {
+			if (v[2] != 0 && v[2] < v[1])
+				v[0] = (double)v[0] * v[1] / v[2];
+			__sync_fetch_and_add(&count[i], v[0]);
+		}
+		if (c->fd[i] >= 0)
+			close(c->fd[i]);
+	}
+}
+
+#else
+
+static inline void bench_counters_open(struct bench_counters *c)
+{
+	int i;
+
+	for (i = 0; i < BENCH_COUNTERS; i++)
+		c->fd[i] = -1;
+}
+
+static inline void bench_counters_enable(struct bench_counters *c, bool on)
+{
+}
+
+static inline void bench_counters_close(struct bench_counters *c,
+					uint64_t *count, bool *missing)
+{
+	int i;
+
+	for (i = 0; i < BENCH_COUNTERS; i++)
+		missing[i] = true;
+}
+
+#endif
+
+struct bench_result {
+	const char *name;
+	int threads;
+	long ops;		/* timed operations, all threads */
+	double median_ns;	/* per operation */
+	double p99_ns;
+	double mops;		/* millions of operations per second */
+	double per_op[BENCH_COUNTERS];	/* events, or -1 if not counted */
+};
+
+static inline uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* CPUs this process may run on */
+static inline int bench_ncpus(void)
+{
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set) != 0)
+		return 1;
+	return CPU_COUNT(&set);
+}
+
+/*
+ * The n'th CPU this process may run on, wrapping around when there are
+ * fewer than n + 1.
+ */
+static inline int bench_cpu(int n)
+{
+	cpu_set_t set;
+	int cpu, count;
+
+	if (sched_getaffinity(0, sizeof(set), &set) != 0 ||
+	    CPU_COUNT(&set) == 0)
+		return 0;
+	n %= CPU_COUNT(&set);
+	for (cpu = 0, count = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &set) && count++ == n)
+			return cpu;
+	}
+	return 0;
+}
+
+/* Pin the calling thread to cpu.  Returns false if that wasn't allowed. */
+static inline bool bench_pin(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+/*
+ * Where two CPUs are relative to each other, as far as sharing caches
+ * goes: the same CPU, hyperthreads of one core, different cores of one
+ * socket, or different sockets.
+ */
+enum bench_place {
+	BENCH_SAME_CPU,
+	BENCH_SMT,
+	BENCH_SAME_SOCKET,
+	BENCH_CROSS_SOCKET,
+	BENCH_PLACES
+};
+
+static const char *const bench_place_names[BENCH_PLACES] = {
+	[BENCH_SAME_CPU]	= "same_cpu",
+	[BENCH_SMT]		= "smt",
+	[BENCH_SAME_SOCKET]	= "same_socket",
+	[BENCH_CROSS_SOCKET]	= "cross_socket",
+};
+
+/* A number from cpu's sysfs topology directory, or -1 if there is none */
+static inline int bench_topo_read(int cpu, const char *what)
+{
+	char path[128];
+	FILE *f;
+	int v = -1;
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, what);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	if (fscanf(f, "%d", &v) != 1)
+		v = -1;
+	fclose(f);
+	return v;
+}
+
+/*
+ * How CPUs a and b are placed.  Without sysfs we can't tell, and call
+ * them different cores of one socket.
+ */
+static inline enum bench_place bench_place_of(int a, int b)
+{
+	int pa, pb;
+
+	if (a == b)
+		return BENCH_SAME_CPU;
+	pa = bench_topo_read(a, "physical_package_id");
+	pb = bench_topo_read(b, "physical_package_id");
+	if (pa >= 0 && pb >= 0 && pa != pb)
+		return BENCH_CROSS_SOCKET;
+	if (pa >= 0 && bench_topo_read(a, "core_id") >= 0 &&
+	    bench_topo_read(a, "core_id") == bench_topo_read(b, "core_id"))
+		return BENCH_SMT;
+	return BENCH_SAME_SOCKET;
+}
+
+/*
+ * Find two CPUs this process may run on that are placed as place, the
+ * first as low numbered as possible.  Returns false if there are none.
+ */
+static inline bool bench_find_pair(enum bench_place place, int *a, int *b)
+{
+	int n = bench_ncpus(), i, j;
+
+	if (place == BENCH_SAME_CPU) {
+		*a = *b = bench_cpu(0);
+		return true;
+	}
+	for (i = 0; i < n; i++) {
+		for (j = i + 1; j < n; j++) {
+			if (bench_place_of(bench_cpu(i), bench_cpu(j)) ==
+			    place) {
+				*a = bench_cpu(i);
+				*b = bench_cpu(j);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+static inline void bench_usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-n ops] [-r reps] [-w warmup] [-t threads] [-j]\n"
+		"  -n  operations per thread per round\n"
+		"  -r  timed rounds\n"
+		"  -w  untimed warmup rounds\n"
+		"  -t  scale from 1 up to this many threads "
+		"(default: number of CPUs)\n"
+		"  -j  JSON output instead of CSV\n",
+		prog);
+	exit(1);
+}
+
+static inline void bench_parse_args(struct bench_opts *o, int argc,
+				    char **argv)
+{
+	int c;
+
+	o->ops = 200000;
+	o->reps = 5;
+	o->warmup = 1;
+	o->max_threads = bench_ncpus();
+	o->json = 0;
+	o->printed = 0;
+
+	while ((c = getopt(argc, argv, "n:r:w:t:j")) != -1) {
+		switch (c) {
+		case 'n':
+			o->ops = atol(optarg);
+			break;
+		case 'r':
+			o->reps = atoi(optarg);
+			break;
+		case 'w':
+			o->warmup = atoi(optarg);
+			break;
+		case 't':
+			o->max_threads = atoi(optarg);
+			break;
+		case 'j':
+			o->json = 1;
+			break;
+		default:
+			bench_usage(argv[0]);
+		}
+	}
+	if (o->ops < BENCH_BATCH || o->reps < 1 || o->warmup < 0 ||
+	    o->max_threads < 1)
+		bench_usage(argv[0]);
+	/* Whole batches only */
+	o->ops -= o->ops % BENCH_BATCH;
+}
+
+/* Thread counts to scale over: 1, 2, 4, ... and then max_threads */
+static inline int bench_next_threads(int t, const struct bench_opts *o)
+{
+	if (t < o->max_threads && t * 2 > o->max_threads)
+		return o->max_threads;
+	return t * 2;
+}
+
+/* One measurement in progress */
+struct bench_run {
+	void (*work)(void *arg, int id, long n);
+	void *arg;
+	const struct bench_opts *o;
+	pthread_barrier_t start, stop;
+	uint64_t *samples;	/* ns per batch, [thread][rep][batch] */
+	long nbatch;		/* batches per thread per round */
+	uint64_t count[BENCH_COUNTERS];	/* events, all threads */
+	bool missing[BENCH_COUNTERS];	/* some thread couldn't count it */
+};
+
+struct bench_thread {
+	struct bench_run *run;
+	int id;
+};
+
+static inline void *bench_thread(void *arg)
+{
+	struct bench_thread *t = arg;
+	struct bench_run *run = t->run;
+	const struct bench_opts *o = run->o;
+	uint64_t *s = run->samples + (long)t->id * o->reps * run->nbatch;
+	struct bench_counters c;
+	uint64_t t0, t1;
+	long b;
+	int rep;
+
+	bench_pin(bench_cpu(t->id));
+	bench_counters_open(&c);
+
+	for (rep = -o->warmup; rep < o->reps; rep++) {
+		pthread_barrier_wait(&run->start);
+		if (rep >= 0)
+			bench_counters_enable(&c, true);
+		t0 = bench_now_ns();
+		for (b = 0; b < run->nbatch; b++) {
+			run->work(run->arg, t->id, BENCH_BATCH);
+			t1 = bench_now_ns();
+			if (rep >= 0)
+				*s++ = t1 - t0;
+			t0 = t1;
+		}
+		if (rep >= 0)
+			bench_counters_enable(&c, false);
+		pthread_barrier_wait(&run->stop);
+	}
+	bench_counters_close(&c, run->count, run->missing);
+	return NULL;
+}
+
+static inline int bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Run work on nthreads threads as described at the top, and fill in r.
+ * Exits if the threads can't be started.
+ */
+static inline void bench_measure(const char *name, int nthreads,
+				 void (*work)(void *arg, int id, long n),
+				 void *arg, const struct bench_opts *o,
+				 struct bench_result *r)
+{
+	struct bench_run run;
+	struct bench_thread *threads;
+	pthread_t *tid;
+	uint64_t t0, wall = 0;
+	long nsamples;
+	int i, rep;
+
+	run.work = work;
+	run.arg = arg;
+	run.o = o;
+	run.nbatch = o->ops / BENCH_BATCH;
+	memset(run.count, 0, sizeof(run.count));
+	memset(run.missing, 0, sizeof(run.missing));
+	nsamples = (long)nthreads * o->reps * run.nbatch;
+	run.samples = malloc(nsamples * sizeof(*run.samples));
+	threads = malloc(nthreads * sizeof(*threads));
+	tid = malloc(nthreads * sizeof(*tid));
+	if (run.samples == NULL || threads == NULL || tid == NULL) {
+		fprintf(stderr, "%s: out of memory\n", name);
+		exit(1);
+	}
+	pthread_barrier_init(&run.start, NULL, nthreads + 1);
+	pthread_barrier_init(&run.stop, NULL, nthreads + 1);
+
+	for (i = 0; i < nthreads; i++) {
+		threads[i].run = &run;
+		threads[i].id = i;
+		errno = pthread_create(&tid[i], NULL, bench_thread,
+				       &threads[i]);
+		if (errno != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	for (rep = -o->warmup; rep < o->reps; rep++) {
+		pthread_barrier_wait(&run.start);
+		t0 = bench_now_ns();
+		pthread_barrier_wait(&run.stop);
+		if (rep >= 0)
+			wall += bench_now_ns() - t0;
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(tid[i], NULL);
+
+	qsort(run.samples, nsamples, sizeof(*run.samples), bench_cmp_u64);
+	r->name = name;
+	r->threads = nthreads;
+	r->ops = (long)nthreads * o->reps * o->ops;
+	r->median_ns = (double)run.samples[nsamples / 2] / BENCH_BATCH;
+	r->p99_ns = (double)run.samples[nsamples * 99 / 100] / BENCH_BATCH;
+	r->mops = wall ? r->ops * 1e3 / wall : 0;
+	for (i = 0; i < BENCH_COUNTERS; i++)
+		r->per_op[i] = run.missing[i] ? -1 :
+			       (double)run.count[i] / r->ops;
+
+	pthread_barrier_destroy(&run.start);
+	pthread_barrier_destroy(&run.stop);
+	free(run.samples);
+	free(threads);
+	free(tid);
+}
+
+/*
+ * A row of output: named fields, printed as one CSV line (with a header
+ * line before the first row) or one JSON object.  All rows printed by a
+ * program should have the same fields.
+ */
+#define BENCH_MAX_FIELDS (16)
+
+struct bench_row {
+	int n;
+	const char *key[BENCH_MAX_FIELDS];
+	char val[BENCH_MAX_FIELDS][48];
+	bool str[BENCH_MAX_FIELDS];	/* quote it in JSON */
+};
+
+static inline void bench_row_init(struct bench_row *row)
+{
+	row->n = 0;
+}
+
+static inline char *bench_row_add(struct bench_row *row, const char *key,
+				  bool str)
+{
+	if (row->n == BENCH_MAX_FIELDS) {
+		fprintf(stderr, "too many fields at %s\n", key);
+		exit(1);
+	}
+	row->key[row->n] = key;
+	row->str[row->n] = str;
+	return row->val[row->n++];
+}
+
+static inline void bench_row_str(struct bench_row *row, const char *key,
+				 const char *v)
+{
+	snprintf(bench_row_add(row, key, true), sizeof(row->val[0]), "%s", v);
+}
+
+static inline void bench_row_long(struct bench_row *row, const char *key,
+				  long v)
+{
+	snprintf(bench_row_add(row, key, false), sizeof(row->val[0]), "%ld",
+		 v);
+}
+
+static inline void bench_row_double(struct bench_row *row, const char *key,
+				    double v)
+{
+	snprintf(bench_row_add(row, key, false), sizeof(row->val[0]), "%.3f",
+		 v);
+}
+
+/* Start the output */
+static inline void bench_begin(struct bench_opts *o)
+{
+	if (o->json)
+		printf("[");
+	o->printed = 0;
+}
+
+static inline void bench_print_row(struct bench_opts *o,
+				   const struct bench_row *row)
+{
+	int i;
+
+	if (o->json) {
+		printf("%s\n  {", o->printed ? "," : "");
+		for (i = 0; i < row->n; i++)
+			printf(row->str[i] ? "%s\"%s\": \"%s\"" : "%s\"%s\": %s",
+			       i ? ", " : "", row->key[i], row->val[i]);
+		printf("}");
+	} else {
+		if (o->printed == 0) {
+			for (i = 0; i < row->n; i++)
+				printf("%s%s", i ? "," : "", row->key[i]);
+			printf("\n");
+		}
+		for (i = 0; i < row->n; i++)
+			printf("%s%s", i ? "," : "", row->val[i]);
+		printf("\n");
+	}
+	o->printed++;
+	fflush(stdout);
+}
+
+/* Print the result of <bench_measure> */
+static inline void bench_print(struct bench_opts *o,
+			       const struct bench_result *r)
+{
+	struct bench_row row;
+	int i;
+
+	bench_row_init(&row);
+	bench_row_str(&row, "benchmark", r->name);
+	bench_row_long(&row, "threads", r->threads);
+	bench_row_long(&row, "ops", r->ops);
+	bench_row_double(&row, "median_ns", r->median_ns);
+	bench_row_double(&row, "p99_ns", r->p99_ns);
+	bench_row_double(&row, "mops", r->mops);
+	/* Events per operation can be tiny, so keep the digits that count */
+	for (i = 0; i < BENCH_COUNTERS; i++)
+		snprintf(bench_row_add(&row, bench_counter_names[i], false),
+			 sizeof(row.val[0]), "%.4g", r->per_op[i]);
+	bench_print_row(o, &row);
+}
+
+/* Finish the output */
+static inline void bench_end(struct bench_opts *o)
+{
+	if (o->json)
+		printf("\n]\n");
+}
+
+/*
+ * A log-linear latency histogram, in the style of HdrHistogram.  Values
+ * below BENCH_HIST_SUB are counted exactly; above that each power of two
+ * is split into BENCH_HIST_SUB buckets, so a value is only ever off by
+ * 1/BENCH_HIST_SUB (about 3%.)  Covers the whole range of a uint64_t in
+ * 15KB, so it never needs sizing and a sample never falls off the end.
+ * Not thread safe: give each thread its own and <bench_hist_merge> them.
+ */
+#define BENCH_HIST_SUB_BITS (5)
+#define BENCH_HIST_SUB (1 << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_BUCKETS ((64 - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB)
+
+struct bench_hist {
+	uint64_t count;
+	uint64_t max;
+	uint64_t bucket[BENCH_HIST_BUCKETS];
+};
+
+static inline void bench_hist_init(struct bench_hist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+static inline int bench_hist_index(uint64_t v)
+{
+	int shift;
+
+	if (v < BENCH_HIST_SUB)
+		return v;
+	shift = 63 - __builtin_clzll(v) - BENCH_HIST_SUB_BITS;
+	return (shift + 1) * BENCH_HIST_SUB + (v >> shift) - BENCH_HIST_SUB;
+}
+
+/* The largest value that goes in bucket i */
+static inline uint64_t bench_hist_value(int i)
+{
+	int shift = i / BENCH_HIST_SUB - 1;
+
+	if (shift < 0)
+		return i;
+	return (((uint64_t)(i % BENCH_HIST_SUB + BENCH_HIST_SUB + 1)) <<
+		shift) - 1;
+}
+
+static inline void bench_hist_add(struct bench_hist *h, uint64_t v)
+{
+	h->bucket[bench_hist_index(v)]++;
+	h->count++;
+	if (v > h->max)
+		h->max = v;
+}
+
+static inline void bench_hist_merge(struct bench_hist *dst,
+				    const struct bench_hist *src)
+{
+	int i;
+
+	for (i = 0; i < BENCH_HIST_BUCKETS; i++)
+		dst->bucket[i] += src->bucket[i];
+	dst->count += src->count;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/* The value below which a fraction p of the samples fall */
+static inline uint64_t bench_hist_percentile(const struct bench_hist *h,
+					     double p)
+{
+	uint64_t want = (uint64_t)(p * h->count + 0.5), seen = 0;
+	int i;
+
+	if (want == 0)
+		want = 1;
+	for (i = 0; i < BENCH_HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= want)
+			break;
+	}
+	if (i == BENCH_HIST_BUCKETS || bench_hist_value(i) > h->max)
+		return h->max;
+	return bench_hist_value(i);
+}
+
+/* Add the usual percentiles of h to a row, in ns */
+static inline void bench_row_hist(struct bench_row *row,
+				  const struct bench_hist *h)
+{
+	bench_row_long(row, "p50_ns", bench_hist_percentile(h, 0.50));
+	bench_row_long(row, "p99_ns", bench_hist_percentile(h, 0.99));
+	bench_row_long(row, "p999_ns", bench_hist_percentile(h, 0.999));
+	bench_row_long(row, "max_ns", h->max);
+}
+
+/*
+ * The least a handoff between two threads can cost: no queue, just a
+ * counted pointer whose counter they take turns moving with
+ * counted_compare_and_swap(), spinning in between.  Each turn is one
+ * cache line transfer.  Turns are numbered from 0 after
+ * <bench_ccas_reset>, and compared modulo the width of the counter, which
+ * is only 15 bits with CCAS_TAGGED.
+ */
+struct bench_padded_ptr {
+	struct counted_ptr cp;
+	char _pad[64 - sizeof(struct counted_ptr)];
+} __attribute__((aligned(64)));
+
+static struct bench_padded_ptr bench_ball;
+
+static inline void bench_ccas_reset(void)
+{
+	counted_set(&bench_ball.cp, NULL, 0, false);
+}
+
+/* Wait until turn comes round, and return the counted pointer then */
+static inline struct counted_ptr bench_ccas_wait(long turn)
+{
+	const int64_t ctr = turn & COUNTED_CTR_MASK;
+	struct counted_ptr c;
+
+	while (counted_get_ctr(c = counted_load(&bench_ball.cp)) != ctr)
+		cpu_relax();
+	return c;
+}
+
+/* Wait for turn, then take it, moving the counter on to turn + 1 */
+static inline void bench_ccas_hit(long turn)
+{
+	if (!counted_compare_and_swap(&bench_ball.cp, bench_ccas_wait(turn),
+				      NULL, 1))
+		printf("ERROR: ccas ping-pong lost a turn\n");
+}
+
+/*
+ * Queue elements for benchmarks, recycled rather than malloc()ed each
+ * time.  Put <bench_msg_free> in aq_init() as the freeer.
+ *
+ * An element is freed by whichever thread drops the last reference to
+ * it, so each thread keeps its own pool, with no atomic operations.  When
+ * a thread exits its pool goes to a shared spare stack, which a thread
+ * whose pool runs dry takes whole before it goes to malloc().  Call
+ * <bench_msg_free_all> at the end, when no other threads are left.
+ */
+struct bench_msg {
+	struct atomic_el amsg;
+	struct as_entry link;	/* on a pool */
+} __attribute__((aligned(16)));
+
+static __thread struct as_entry *bench_msg_pool;
+static __thread bool bench_msg_registered;
+static struct as_head bench_msg_spare __attribute__((aligned(16)));
+static pthread_key_t bench_msg_key;
+static pthread_once_t bench_msg_once = PTHREAD_ONCE_INIT;
+
+/* Hand the calling thread's pool to the spare stack */
+static inline void bench_msg_exit(void *arg)
+{
+	struct as_entry *last = bench_msg_pool;
+
+	if (last == NULL)
+		return;
+	while (last->next != NULL)
+		last = last->next;
+	as_push_list(&bench_msg_spare, bench_msg_pool, last);
+	bench_msg_pool = NULL;
+}
+
+static inline void bench_msg_key_init(void)
+{
+	pthread_key_create(&bench_msg_key, bench_msg_exit);
+}
+
+/* Make sure bench_msg_exit() runs when the calling thread exits */
+static inline void bench_msg_register(void)
+{
+	if (__builtin_expect(bench_msg_registered, 1))
+		return;
+	pthread_once(&bench_msg_once, bench_msg_key_init);
+	pthread_setspecific(bench_msg_key, (void *)1);
+	bench_msg_registered = true;
+}
+
+static inline void bench_msg_free(void *arg, struct atomic_el *el)
+{
+	struct bench_msg *m = container_of(el, struct bench_msg, amsg);
+
+	bench_msg_register();
+	m->link.next = bench_msg_pool;
+	bench_msg_pool = &m->link;
+}
+
+/* An initialized element.  Exits if there is no memory. */
+static inline struct bench_msg *bench_msg_get(void)
+{
+	struct as_entry *e = bench_msg_pool;
+	struct bench_msg *m;
+
+	if (e == NULL)
+		e = as_pop_all(&bench_msg_spare);
+	if (e != NULL) {
+		bench_msg_pool = e->next;
+		m = container_of(e, struct bench_msg, link);
+	} else {
+		m = aligned_alloc(16, sizeof(*m));
+		if (m == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	aq_el_init(&m->amsg);
+	return m;
+}
+
+/* Free every element in the calling thread's pool and the spare stack */
+static inline void bench_msg_free_all(void)
+{
+	struct as_entry *e, *next;
+
+	bench_msg_exit(NULL);
+	for (e = as_pop_all(&bench_msg_spare); e != NULL; e = next) {
+		next = e->next;
+		free(container_of(e, struct bench_msg, link));
+	}
+}
+
+#endif
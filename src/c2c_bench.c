@@ -0,0 +1,307 @@
+#include "bench.h"
+#include "ccas.h"
+#include "util.h"
+/*****************************************************************************
+ * What it costs to move a struct counted_ptr between every pair of CPUs.
+ *
+ * For each pair of CPUs this process may run on, two threads pinned to
+ * them take turns moving the counter of one counted pointer with
+ * bench_ccas_hit(), as the ccas rows of pingpong_bench.c do.  Round trips
+ * are timed BENCH_BATCH at a time.  The one way latency of a pair is half
+ * the median batch, divided by BENCH_BATCH, and the lowest of the timed
+ * rounds.
+ *
+ * The output is the N by N matrix of one way latencies in ns, and then
+ * the CPUs grouped into sharing domains.  Sort all the latencies, and
+ * wherever one is more than C2C_GAP times the one before, there is a
+ * level of the cache hierarchy below it: SMT siblings, a shared L2 or L3
+ * cluster, a socket.  For each such level, CPUs are in one domain if they
+ * are connected by pairs at or below it.  The level with every CPU in one
+ * domain is left out.
+ *
+ * CSV output is the matrix, a row per CPU, then one row per domain:
+ *
+ *     level,threshold_ns,domain,cpus
+ *
+ * with the CPUs separated by spaces.  With -j it is one JSON object with
+ * "cpus", "one_way_ns" and "levels", for scripts that place threads.
+ *
+ * -n is the number of round trips per pair per round, and -t is ignored.
+ * There are N * (N - 1) / 2 pairs, so lower -n on big machines.
+ ****************************************************************************/
+
+#define C2C_GAP (1.3)
+
+struct c2c_pair {
+	int cpu[2];
+	long nbatch;		/* batches per round */
+	int rounds;		/* all rounds, warmup first */
+	uint64_t *samples;	/* ns per batch, timed rounds only */
+	int warmup;
+};
+
+static pthread_barrier_t start;
+
+static void *c2c_ping(void *arg)
+{
+	struct c2c_pair *p = arg;
+	uint64_t *s = p->samples;
+	uint64_t t0, t1;
+	long b, i, turn = 0;
+	int round;
+
+	bench_pin(p->cpu[0]);
+	pthread_barrier_wait(&start);
+	for (round = 0; round < p->rounds; round++) {
+		t0 = bench_now_ns();
+		for (b = 0; b < p->nbatch; b++) {
+			for (i = 0; i < BENCH_BATCH; i++, turn += 2)
+				bench_ccas_hit(turn);
+			/* The last turn must come back before we stop */
+			bench_ccas_wait(turn);
+			t1 = bench_now_ns();
+			if (round >= p->warmup)
+				*s++ = t1 - t0;
+			t0 = t1;
+		}
+	}
+	return NULL;
+}
+
+static void *c2c_pong(void *arg)
+{
+	struct c2c_pair *p = arg;
+	long i, n = p->rounds * p->nbatch * BENCH_BATCH;
+
+	bench_pin(p->cpu[1]);
+	pthread_barrier_wait(&start);
+	for (i = 0; i < n; i++)
+		bench_ccas_hit(2 * i + 1);
+	return NULL;
+}
+
+/* One way latency between CPUs a and b, in ns */
+static double c2c_measure(const struct bench_opts *o, int a, int b)
+{
+	struct c2c_pair p;
+	pthread_t tid[2];
+	double best = 0, ns;
+	int round;
+
+	p.cpu[0] = a;
+	p.cpu[1] = b;
+	p.nbatch = o->ops / BENCH_BATCH;
+	p.warmup = o->warmup;
+	p.rounds = o->warmup + o->reps;
+	p.samples = malloc(o->reps * p.nbatch * sizeof(*p.samples));
+	if (p.samples == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	bench_ccas_reset();
+	pthread_barrier_init(&start, NULL, 2);
+
+	pthread_create(&tid[0], NULL, c2c_ping, &p);
+	pthread_create(&tid[1], NULL, c2c_pong, &p);
+	pthread_join(tid[0], NULL);
+	pthread_join(tid[1], NULL);
+	pthread_barrier_destroy(&start);
+
+	for (round = 0; round < o->reps; round++) {
+		qsort(p.samples + round * p.nbatch, p.nbatch,
+		      sizeof(*p.samples), bench_cmp_u64);
+		ns = (double)p.samples[round * p.nbatch + p.nbatch / 2] /
+		     BENCH_BATCH / 2;
+		if (round == 0 || ns < best)
+			best = ns;
+	}
+	free(p.samples);
+	return best;
+}
+
+static int uf_find(int *parent, int i)
+{
+	while (parent[i] != i)
+		i = parent[i] = parent[parent[i]];
+	return i;
+}
+
+/*
+ * Group the n CPUs into domains of pairs at most threshold ns apart.
+ * domain[i] is the lowest index in CPU i's domain.  Returns the number of
+ * domains.
+ */
+static int c2c_domains(const double *lat, int n, double threshold,
+		       int *domain)
+{
+	int i, j, a, b, count = n;
+
+	for (i = 0; i < n; i++)
+		domain[i] = i;
+	for (i = 0; i < n; i++) {
+		for (j = i + 1; j < n; j++) {
+			if (lat[i * n + j] > threshold)
+				continue;
+			a = uf_find(domain, i);
+			b = uf_find(domain, j);
+			if (a == b)
+				continue;
+			domain[a > b ? a : b] = a < b ? a : b;
+			count--;
+		}
+	}
+	for (i = 0; i < n; i++)
+		domain[i] = uf_find(domain, i);
+	return count;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * The thresholds between levels of the hierarchy: each latency that the
+ * next is more than C2C_GAP times.  Returns how many, at most n * n.
+ */
+static int c2c_levels(const double *lat, int n, double *level)
+{
+	double *sorted;
+	int i, j, m = 0, nlevels = 0;
+
+	sorted = malloc((n * n + 1) * sizeof(*sorted));
+	if (sorted == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < n; i++)
+		for (j = i + 1; j < n; j++)
+			sorted[m++] = lat[i * n + j];
+	qsort(sorted, m, sizeof(*sorted), cmp_double);
+	for (i = 0; i + 1 < m; i++)
+		if (sorted[i + 1] > sorted[i] * C2C_GAP)
+			level[nlevels++] = sorted[i];
+	free(sorted);
+	return nlevels;
+}
+
+/* The CPUs in domain d, separated by sep */
+static void print_cpus(const int *cpu, const int *domain, int n, int d,
+		       const char *sep)
+{
+	int i, first = 1;
+
+	for (i = 0; i < n; i++) {
+		if (domain[i] != d)
+			continue;
+		printf("%s%d", first ? "" : sep, cpu[i]);
+		first = 0;
+	}
+}
+
+static void print_csv(const int *cpu, const double *lat, int n,
+		      const double *level, int nlevels, int *domain)
+{
+	int i, j, l, d;
+
+	printf("cpu");
+	for (j = 0; j < n; j++)
+		printf(",%d", cpu[j]);
+	printf("\n");
+	for (i = 0; i < n; i++) {
+		printf("%d", cpu[i]);
+		for (j = 0; j < n; j++)
+			printf(",%.1f", lat[i * n + j]);
+		printf("\n");
+	}
+
+	printf("\nlevel,threshold_ns,domain,cpus\n");
+	for (l = 0; l < nlevels; l++) {
+		c2c_domains(lat, n, level[l], domain);
+		for (i = 0, d = 0; i < n; i++) {
+			if (domain[i] != i)
+				continue;
+			printf("%d,%.1f,%d,", l, level[l], d++);
+			print_cpus(cpu, domain, n, i, " ");
+			printf("\n");
+		}
+	}
+}
+
+static void print_json(const int *cpu, const double *lat, int n,
+		       const double *level, int nlevels, int *domain)
+{
+	int i, j, l, first;
+
+	printf("{\n  \"cpus\": [");
+	for (i = 0; i < n; i++)
+		printf("%s%d", i ? ", " : "", cpu[i]);
+	printf("],\n  \"one_way_ns\": [\n");
+	for (i = 0; i < n; i++) {
+		printf("    [");
+		for (j = 0; j < n; j++)
+			printf("%s%.1f", j ? ", " : "", lat[i * n + j]);
+		printf("]%s\n", i + 1 < n ? "," : "");
+	}
+	printf("  ],\n  \"levels\": [");
+	for (l = 0; l < nlevels; l++) {
+		c2c_domains(lat, n, level[l], domain);
+		printf("%s\n    {\"threshold_ns\": %.1f, \"domains\": [",
+		       l ? "," : "", level[l]);
+		for (i = 0, first = 1; i < n; i++) {
+			if (domain[i] != i)
+				continue;
+			printf("%s[", first ? "" : ", ");
+			print_cpus(cpu, domain, n, i, ", ");
+			printf("]");
+			first = 0;
+		}
+		printf("]}");
+	}
+	printf("%s]\n}\n", nlevels ? "\n  " : "");
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_opts o;
+	double *lat, *level;
+	int *cpu, *domain;
+	int n, i, j, l, nlevels;
+
+	bench_parse_args(&o, argc, argv);
+	n = bench_ncpus();
+	cpu = malloc(n * sizeof(*cpu));
+	domain = malloc(n * sizeof(*domain));
+	lat = calloc(n * n, sizeof(*lat));
+	level = malloc((n * n + 1) * sizeof(*level));
+	if (cpu == NULL || domain == NULL || lat == NULL || level == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < n; i++)
+		cpu[i] = bench_cpu(i);
+
+	for (i = 0; i < n; i++)
+		for (j = i + 1; j < n; j++)
+			lat[i * n + j] = lat[j * n + i] =
+				c2c_measure(&o, cpu[i], cpu[j]);
+
+	/* Everything in one domain tells nobody anything */
+	nlevels = c2c_levels(lat, n, level);
+	for (i = 0, l = 0; i < nlevels; i++)
+		if (c2c_domains(lat, n, level[i], domain) > 1)
+			level[l++] = level[i];
+	nlevels = l;
+	if (o.json)
+		print_json(cpu, lat, n, level, nlevels, domain);
+	else
+		print_csv(cpu, lat, n, level, nlevels, domain);
+
+	free(cpu);
+	free(domain);
+	free(lat);
+	free(level);
+	return 0;
+}
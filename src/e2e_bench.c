@@ -0,0 +1,292 @@
+#include "bench.h"
+#include "atomic_q.h"
+#include "atomic_stack.h"
+#include "util.h"
+/*****************************************************************************
+ * End to end benchmark: producers send messages through one atomic_q to
+ * consumers, as in aq_test.c, and we measure throughput and how long each
+ * message sat in the queue.
+ *
+ * Every message is stamped with CLOCK_MONOTONIC just before aq_enqueue(),
+ * and the consumer that dequeues it records the difference in its own
+ * histogram (see struct bench_hist.)  The producer fills in payload bytes
+ * before sending and the consumer reads all of them after, so the cost of
+ * moving the payload between caches shows up too.  Consumers wait in
+ * aq_dequeue_spinwait(), so they do not hog the CPU when there are more
+ * threads than CPUs.
+ *
+ * Each producer owns POOL messages.  Consumers give them back through the
+ * producer's own struct as_head once the queue is done with them, and a
+ * producer with none left waits for some to come back.  That bounds the
+ * queue to producers * POOL messages, so a slow consumer shows up as
+ * lower throughput rather than ever growing latency.
+ *
+ * The scenarios sweep, one thing at a time:
+ *
+ *     producer:consumer ratio   1:1, 1:3, 3:1, 2:2, 4:4, 64 byte payloads
+ *     payload size              0 to 4096 bytes, 1:1
+ *     oversubscription          2 and 4 threads per CPU, half producers
+ *
+ * where the CPUs are those this process may run on (bench_ncpus()), which
+ * is also what the threads_per_cpu column is against.  -n is the number
+ * of messages per producer per round, and -t is ignored.  Output is one
+ * row per scenario with throughput and p50/p99/p99.9/max sojourn time.
+ ****************************************************************************/
+
+#define POOL (256)
+#define MAX_PAYLOAD (4096)
+
+struct e2e_msg {
+	struct atomic_el amsg;
+	struct as_entry ret;	/* on the owner's return stack */
+	uint64_t stamp;		/* when it was enqueued */
+	int owner;		/* producer, or -1 for dummies and shutdown */
+	int len;		/* payload bytes */
+	unsigned char payload[];
+} __attribute__((aligned(64)));
+
+struct e2e_producer {
+	struct as_head returned;
+	char _pad[64 - sizeof(struct as_head)];
+	struct e2e_msg *msgs;	/* POOL of them */
+} __attribute__((aligned(64)));
+
+struct e2e_consumer {
+	struct bench_hist hist;
+	uint64_t sum;		/* of the payload bytes, so they are read */
+} __attribute__((aligned(64)));
+
+struct e2e_scenario {
+	const char *name;
+	int producers;
+	int consumers;
+	int payload;
+};
+
+static struct atomic_q queue __attribute__((aligned(64)));
+static struct e2e_producer *producers;
+static struct e2e_consumer *consumers;
+static struct e2e_msg *shutdown_msgs;
+static pthread_barrier_t start;
+static long per_producer;
+static int payload_len;
+static int nproducers;
+
+static size_t msg_size(void)
+{
+	return (sizeof(struct e2e_msg) + MAX_PAYLOAD + 63) & ~63UL;
+}
+
+static struct e2e_msg *msg_at(struct e2e_msg *base, int i)
+{
+	return (struct e2e_msg *)((char *)base + i * msg_size());
+}
+
+static void free_msg(void *arg, struct atomic_el *el)
+{
+	struct e2e_msg *m = container_of(el, struct e2e_msg, amsg);
+
+	if (m->owner >= 0)
+		as_push(&producers[m->owner].returned, &m->ret);
+}
+
+static void *producer(void *arg)
+{
+	long id = (long)arg;
+	struct e2e_producer *p = &producers[id];
+	struct as_entry *free_list = NULL, *e;
+	struct e2e_msg *m;
+	long i;
+
+	bench_pin(bench_cpu(id));
+	for (i = 0; i < POOL; i++) {
+		m = msg_at(p->msgs, i);
+		m->owner = id;
+		m->ret.next = free_list;
+		free_list = &m->ret;
+	}
+
+	pthread_barrier_wait(&start);
+	for (i = 0; i < per_producer; i++) {
+		while (free_list == NULL) {
+			free_list = as_pop_all(&p->returned);
+			if (free_list == NULL)
+				sched_yield();
+		}
+		e = free_list;
+		free_list = e->next;
+		m = container_of(e, struct e2e_msg, ret);
+
+		aq_el_init(&m->amsg);
+		m->len = payload_len;
+		memset(m->payload, (int)i, m->len);
+		m->stamp = bench_now_ns();
+		aq_enqueue(&queue, &m->amsg);
+	}
+	return NULL;
+}
+
+static void *consumer(void *arg)
+{
+	long id = (long)arg;
+	struct e2e_consumer *c = &consumers[id];
+	struct atomic_el *el;
+	struct e2e_msg *m;
+	struct aq_waiter w;
+	uint64_t now, sum = 0;
+	int i;
+
+	/* Producers are on the first CPUs, consumers after them */
+	bench_pin(bench_cpu(nproducers + id));
+	aq_waiter_init(&w, AQ_WAIT_ADAPTIVE);
+
+	pthread_barrier_wait(&start);
+	for (;;) {
+		el = aq_dequeue_spinwait(&queue, AQ_BLOCK, &w);
+		now = bench_now_ns();
+		m = container_of(el, struct e2e_msg, amsg);
+		if (m->owner < 0) {
+			aq_el_free(&queue, el);
+			break;
+		}
+		bench_hist_add(&c->hist, now - m->stamp);
+		for (i = 0; i < m->len; i++)
+			sum += m->payload[i];
+		aq_el_free(&queue, el);
+	}
+	c->sum += sum;
+	return NULL;
+}
+
+/* Run one scenario reps times, after warmup untimed ones, and print it */
+static void run(struct bench_opts *o, const struct e2e_scenario *s)
+{
+	int np = s->producers, nc = s->consumers;
+	pthread_t tid[np + nc];
+	struct bench_hist *all;
+	struct bench_row row;
+	struct e2e_msg *dummy;
+	uint64_t t0, wall = 0;
+	long i;
+	int rep;
+
+	all = malloc(sizeof(*all));
+	producers = aligned_alloc(64, np * sizeof(*producers));
+	consumers = aligned_alloc(64, nc * sizeof(*consumers));
+	shutdown_msgs = aligned_alloc(64, (nc + 1) * msg_size());
+	if (all == NULL || producers == NULL || consumers == NULL ||
+	    shutdown_msgs == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < np; i++) {
+		producers[i].msgs = aligned_alloc(64, POOL * msg_size());
+		if (producers[i].msgs == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	bench_hist_init(all);
+	per_producer = o->ops;
+	nproducers = np;
+	payload_len = s->payload;
+
+	for (rep = -o->warmup; rep < o->reps; rep++) {
+		for (i = 0; i < np; i++)
+			as_init(&producers[i].returned);
+		for (i = 0; i < nc; i++) {
+			bench_hist_init(&consumers[i].hist);
+			consumers[i].sum = 0;
+		}
+		dummy = msg_at(shutdown_msgs, nc);
+		dummy->owner = -1;
+		aq_el_init(&dummy->amsg);
+		aq_init(&queue, &dummy->amsg, free_msg, NULL);
+		pthread_barrier_init(&start, NULL, np + nc + 1);
+
+		for (i = 0; i < np; i++)
+			pthread_create(&tid[i], NULL, producer, (void *)i);
+		for (i = 0; i < nc; i++)
+			pthread_create(&tid[np + i], NULL, consumer, (void *)i);
+		pthread_barrier_wait(&start);
+		t0 = bench_now_ns();
+
+		for (i = 0; i < np; i++)
+			pthread_join(tid[i], NULL);
+		for (i = 0; i < nc; i++) {
+			msg_at(shutdown_msgs, i)->owner = -1;
+			aq_el_init(&msg_at(shutdown_msgs, i)->amsg);
+			aq_enqueue(&queue, &msg_at(shutdown_msgs, i)->amsg);
+		}
+		for (i = 0; i < nc; i++)
+			pthread_join(tid[np + i], NULL);
+
+		if (rep >= 0) {
+			wall += bench_now_ns() - t0;
+			for (i = 0; i < nc; i++)
+				bench_hist_merge(all, &consumers[i].hist);
+		}
+		aq_free(&queue);
+		pthread_barrier_destroy(&start);
+	}
+
+	if (all->count != (uint64_t)np * o->ops * o->reps)
+		printf("ERROR: %s sent %ld messages, received %lu\n", s->name,
+		       (long)np * o->ops * o->reps, (unsigned long)all->count);
+
+	bench_row_init(&row);
+	bench_row_str(&row, "benchmark", s->name);
+	bench_row_long(&row, "producers", np);
+	bench_row_long(&row, "consumers", nc);
+	bench_row_long(&row, "payload", s->payload);
+	bench_row_double(&row, "threads_per_cpu",
+			 (double)(np + nc) / bench_ncpus());
+	bench_row_long(&row, "msgs", all->count);
+	bench_row_double(&row, "mmsgs", wall ? all->count * 1e3 / wall : 0);
+	bench_row_hist(&row, all);
+	bench_print_row(o, &row);
+
+	for (i = 0; i < np; i++)
+		free(producers[i].msgs);
+	free(producers);
+	free(consumers);
+	free(shutdown_msgs);
+	free(all);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct e2e_scenario fixed[] = {
+		{ "ratio", 1, 1, 64 },
+		{ "ratio", 1, 3, 64 },
+		{ "ratio", 3, 1, 64 },
+		{ "ratio", 2, 2, 64 },
+		{ "ratio", 4, 4, 64 },
+		{ "payload", 1, 1, 0 },
+		{ "payload", 1, 1, 256 },
+		{ "payload", 1, 1, 1024 },
+		{ "payload", 1, 1, 4096 },
+	};
+	struct e2e_scenario s;
+	struct bench_opts o;
+	unsigned int i;
+	int over, ncpus;
+
+	bench_parse_args(&o, argc, argv);
+	ncpus = bench_ncpus();
+	bench_begin(&o);
+
+	for (i = 0; i < sizeof(fixed) / sizeof(fixed[0]); i++)
+		run(&o, &fixed[i]);
+
+	for (over = 2; over <= 4; over *= 2) {
+		s.name = "oversubscribed";
+		s.producers = ncpus * over / 2;
+		s.consumers = ncpus * over - s.producers;
+		s.payload = 64;
+		run(&o, &s);
+	}
+
+	bench_end(&o);
+	return 0;
+}
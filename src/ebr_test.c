@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "atomic_q.h"
+#include "atomic_stack.h"
+#include "epoch.h"
+#include "util.h"
+#include "reclaim_test.h"
+/*****************************************************************************
+ * Unit tests for epoch (EBR and QSBR) mode.  As in hp_test.c, every element
+ * comes from malloc() and is poisoned and returned to free() as soon as
+ * the domain says nobody can reference it any more.
+ *
+ * For each mode, NUM_THREADS senders and receivers pass NMSG messages
+ * through a struct atomic_q, then NUM_THREADS threads push and pop NMSG
+ * entries on a struct as_head.  In QSBR mode every thread announces a
+ * quiescent state between messages.  At the end every allocation must
+ * have been freed, and some of the messages must have been freed while the
+ * threads were still running (i.e. epochs advanced.)  How far the limbo
+ * lists grew is printed; it depends mostly on how long threads get
+ * preempted.
+ ****************************************************************************/
+
+#define NMSG (200000L)
+#define NUM_THREADS (4)
+static const long SHUTDOWN = -1;
+
+static struct ebr_domain dom;
+static long msgs_sent, msgs_received;
+static int max_pending;
+
+/* Raise max_pending to this thread's limbo count, if that is higher */
+static void note_pending(struct ebr_thread *et)
+{
+	int n = ebr_pending(et);
+	int old = __atomic_load_n(&max_pending, __ATOMIC_RELAXED);
+
+	while (n > old &&
+	       !__atomic_compare_exchange_n(&max_pending, &old, n, false,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void *sender(void *arg)
+{
+	struct atomic_q *mb = (struct atomic_q *)arg;
+	struct ebr_thread *et = ebr_thread_acquire(&dom);
+
+	while (__sync_fetch_and_add(&msgs_sent, 1) < NMSG) {
+		aq_enqueue_ebr(mb, &new_msg(0)->amsg, et);
+		ebr_quiescent(et);
+	}
+	__sync_fetch_and_sub(&msgs_sent, 1);
+
+	ebr_thread_release(et);
+	return NULL;
+}
+
+static void *receiver(void *arg)
+{
+	struct atomic_q *mb = (struct atomic_q *)arg;
+	struct ebr_thread *et = ebr_thread_acquire(&dom);
+	struct atomic_el *el;
+	long payload;
+
+	for (;;) {
+		while ((el = aq_dequeue_ebr(mb, et)) == NULL) {
+			ebr_quiescent(et);
+			sched_yield();
+		}
+		payload = container_of(el, struct mymsg, amsg)->payload;
+		aq_el_free_ebr(mb, el, et);
+		ebr_quiescent(et);
+		note_pending(et);
+		if (payload == SHUTDOWN)
+			break;
+		if (payload != 0)
+			printf("ERROR: Received corrupt message\n");
+		__sync_fetch_and_add(&msgs_received, 1);
+	}
+
+	ebr_thread_release(et);
+	return NULL;
+}
+
+static void *stacker(void *arg)
+{
+	struct as_head *s = (struct as_head *)arg;
+	struct ebr_thread *et = ebr_thread_acquire(&dom);
+	struct myentry *e;
+	long i;
+
+	for (i = 0; i < NMSG / NUM_THREADS; i++) {
+		e = alloc(sizeof(*e));
+		e->payload = 0;
+		as_push(s, &e->ase);
+
+		e = (struct myentry *)as_pop_ebr(s, et);
+		if (e == NULL || e->payload != 0)
+			printf("ERROR: Popped corrupt entry\n");
+		else
+			ebr_retire(et, e, free_entry, NULL);
+		ebr_quiescent(et);
+		note_pending(et);
+	}
+
+	ebr_thread_release(et);
+	return NULL;
+}
+
+static void run(enum ebr_mode mode)
+{
+	pthread_t stid[NUM_THREADS], rtid[NUM_THREADS];
+	struct atomic_q mb __attribute__((aligned(64)));
+	struct as_head s __attribute__((aligned(16)));
+	struct ebr_thread *et;
+	long early_free;
+	int i;
+
+	ebr_domain_init(&dom, mode);
+	num_alloc = num_free = 0;
+	msgs_sent = msgs_received = 0;
+	max_pending = 0;
+
+	/* Queue */
+	aq_init_ebr(&mb, &new_msg(0)->amsg, free_msg, (void *)0xbaddecaf, &dom);
+	for (i = 0; i < NUM_THREADS; i++) {
+		pthread_create(&stid[i], NULL, sender, &mb);
+		pthread_create(&rtid[i], NULL, receiver, &mb);
+	}
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_join(stid[i], NULL);
+	et = ebr_thread_acquire(&dom);
+	for (i = 0; i < NUM_THREADS; i++)
+		aq_enqueue_ebr(&mb, &new_msg(SHUTDOWN)->amsg, et);
+	ebr_thread_release(et);
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_join(rtid[i], NULL);
+	early_free = num_free;
+	aq_free(&mb);
+
+	if (msgs_received != NMSG)
+		printf("ERROR: Sent %ld messages, received %ld\n",
+		       msgs_sent, msgs_received);
+
+	/* Stack */
+	as_init(&s);
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_create(&stid[i], NULL, stacker, &s);
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_join(stid[i], NULL);
+	if (!as_empty(&s))
+		printf("ERROR: Final stack not empty!\n");
+	ebr_domain_drain(&dom);
+
+	if (num_alloc != num_free)
+		printf("ERROR: Allocated %ld, freed %ld\n", num_alloc, num_free);
+	if (early_free == 0)
+		printf("ERROR: Nothing reclaimed before the drain\n");
+
+	printf("%s test: exchanged %ld messages, at most %d pending\n",
+	       mode == EBR_QSBR ? "qsbr" : "epoch", msgs_received, max_pending);
+}
+
+int main(int argc, char **argv)
+{
+	run(EBR_EPOCH);
+	run(EBR_QSBR);
+
+	return 0;
+}
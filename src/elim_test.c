@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "as_elim.h"
+#include "util.h"
+/*****************************************************************************
+ * Unit tests for the elimination-backoff stack.  NUM_THREADS threads share
+ * a pool of NENTRIES entries.  Each thread starts with its share, and
+ * repeatedly pushes everything it holds and pops as many back, NITER
+ * times.  Every entry carries a flag saying whether it is on the stack, so
+ * an entry popped twice (or pushed twice) shows up straight away.
+ *
+ * At the end the stack must hold every entry exactly once.
+ ****************************************************************************/
+
+#define NITER (100000L)
+#define NUM_THREADS (8)
+#define NENTRIES (NUM_THREADS * 4)
+#define PER_THREAD (NENTRIES / NUM_THREADS)
+
+struct myentry {
+	struct as_entry ase;
+	int on_stack;
+};
+
+static struct as_elim_stack stack __attribute__((aligned(64)));
+static struct myentry entries[NENTRIES] __attribute__((aligned(16)));
+
+static void *worker(void *arg)
+{
+	long id = (long)arg;
+	struct myentry *held[PER_THREAD];
+	struct as_entry *e;
+	long i;
+	int j;
+
+	for (j = 0; j < PER_THREAD; j++)
+		held[j] = &entries[id * PER_THREAD + j];
+
+	for (i = 0; i < NITER; i++) {
+		for (j = 0; j < PER_THREAD; j++) {
+			if (!__sync_bool_compare_and_swap(&held[j]->on_stack,
+							  0, 1))
+				printf("ERROR: Pushed an entry twice\n");
+			as_elim_push(&stack, &held[j]->ase);
+		}
+		for (j = 0; j < PER_THREAD; j++) {
+			/* Others may be holding some of them for a moment */
+			while ((e = as_elim_pop(&stack)) == NULL)
+				sched_yield();
+			held[j] = container_of(e, struct myentry, ase);
+			if (!__sync_bool_compare_and_swap(&held[j]->on_stack,
+							  1, 0))
+				printf("ERROR: Popped an entry twice\n");
+		}
+	}
+
+	for (j = 0; j < PER_THREAD; j++) {
+		held[j]->on_stack = 1;
+		as_elim_push(&stack, &held[j]->ase);
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t tid[NUM_THREADS];
+	char seen[NENTRIES];
+	struct as_entry *e;
+	long i;
+	int n = 0;
+
+	as_elim_init(&stack);
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_create(&tid[i], NULL, worker, (void *)i);
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_join(tid[i], NULL);
+
+	memset(seen, 0, sizeof(seen));
+	while ((e = as_elim_pop(&stack)) != NULL && n <= NENTRIES) {
+		i = container_of(e, struct myentry, ase) - entries;
+		if (i < 0 || i >= NENTRIES || seen[i]++)
+			printf("ERROR: Bad entry %p on the stack\n", e);
+		n++;
+	}
+	if (n != NENTRIES)
+		printf("ERROR: %d entries, %d on the stack\n", NENTRIES, n);
+
+	printf("elimination test: %ld push/pop pairs by %d threads\n",
+	       NITER * PER_THREAD * NUM_THREADS, NUM_THREADS);
+
+	return 0;
+}
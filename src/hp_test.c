@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "atomic_q.h"
+#include "atomic_stack.h"
+#include "hazard.h"
+#include "util.h"
+#include "reclaim_test.h"
+/*****************************************************************************
+ * Unit tests for hazard pointer mode.  Unlike aq_test.c, every element here
+ * comes from malloc() and goes back to free() as soon as the queue (or
+ * stack) lets go of it, after being overwritten with garbage.  A read of a
+ * freed element would then see the garbage, and should crash or trip an
+ * assert, and this test should be clean under valgrind.
+ *
+ * NUM_THREADS senders and receivers pass NMSG messages through a struct
+ * atomic_q, then NUM_THREADS threads push and pop NMSG entries on a struct
+ * as_head.  At the end every allocation must have been freed.
+ ****************************************************************************/
+
+#define NMSG (200000L)
+#define NUM_THREADS (4)
+static const long SHUTDOWN = -1;
+
+static struct hp_domain dom;
+static long msgs_sent, msgs_received;
+
+static void *sender(void *arg)
+{
+	struct atomic_q *mb = (struct atomic_q *)arg;
+	struct hp_thread *ht = hp_thread_acquire(&dom);
+
+	while (__sync_fetch_and_add(&msgs_sent, 1) < NMSG)
+		aq_enqueue_hp(mb, &new_msg(0)->amsg, ht);
+	__sync_fetch_and_sub(&msgs_sent, 1);
+
+	hp_thread_release(ht);
+	return NULL;
+}
+
+static void *receiver(void *arg)
+{
+	struct atomic_q *mb = (struct atomic_q *)arg;
+	struct hp_thread *ht = hp_thread_acquire(&dom);
+	struct atomic_el *el;
+	long payload;
+
+	for (;;) {
+		while ((el = aq_dequeue_hp(mb, ht)) == NULL)
+			sched_yield();
+		payload = container_of(el, struct mymsg, amsg)->payload;
+		aq_el_free_hp(mb, el, ht);
+		if (payload == SHUTDOWN)
+			break;
+		if (payload != 0)
+			printf("ERROR: Received corrupt message\n");
+		__sync_fetch_and_add(&msgs_received, 1);
+	}
+
+	hp_thread_release(ht);
+	return NULL;
+}
+
+static void *stacker(void *arg)
+{
+	struct as_head *s = (struct as_head *)arg;
+	struct hp_thread *ht = hp_thread_acquire(&dom);
+	struct myentry *e;
+	long i;
+
+	for (i = 0; i < NMSG / NUM_THREADS; i++) {
+		e = alloc(sizeof(*e));
+		e->payload = 0;
+		as_push(s, &e->ase);
+
+		e = (struct myentry *)as_pop_hp(s, ht);
+		if (e == NULL || e->payload != 0)
+			printf("ERROR: Popped corrupt entry\n");
+		else
+			hp_retire(ht, e, free_entry, NULL);
+	}
+
+	hp_thread_release(ht);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t stid[NUM_THREADS], rtid[NUM_THREADS];
+	struct atomic_q mb __attribute__((aligned(64)));
+	struct as_head s __attribute__((aligned(16)));
+	struct hp_thread *ht;
+	int i;
+
+	hp_domain_init(&dom);
+	ht = hp_thread_acquire(&dom);
+
+	/* Queue */
+	aq_init_hp(&mb, &new_msg(0)->amsg, free_msg, (void *)0xbaddecaf, &dom);
+	for (i = 0; i < NUM_THREADS; i++) {
+		pthread_create(&stid[i], NULL, sender, &mb);
+		pthread_create(&rtid[i], NULL, receiver, &mb);
+	}
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_join(stid[i], NULL);
+	for (i = 0; i < NUM_THREADS; i++)
+		aq_enqueue_hp(&mb, &new_msg(SHUTDOWN)->amsg, ht);
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_join(rtid[i], NULL);
+	hp_thread_release(ht);
+	aq_free(&mb);
+
+	if (msgs_received != NMSG)
+		printf("ERROR: Sent %ld messages, received %ld\n",
+		       msgs_sent, msgs_received);
+
+	/* Stack */
+	as_init(&s);
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_create(&stid[i], NULL, stacker, &s);
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_join(stid[i], NULL);
+	if (!as_empty(&s))
+		printf("ERROR: Final stack not empty!\n");
+	hp_domain_drain(&dom);
+
+	if (num_alloc != num_free)
+		printf("ERROR: Allocated %ld, freed %ld\n", num_alloc, num_free);
+
+	printf("hazard pointer test: exchanged %ld messages\n", msgs_received);
+
+	return 0;
+}
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "ccas.h"
+#include "util.h"
+/*****************************************************************************
+ * Benchmark for counted_load() against counted_read().  Two runs each:
+ *
+ * Tearing: one thread keeps moving a counted pointer whose pointer is
+ * always its counter times 16, while NUM_READERS threads read it and count
+ * snapshots where the two disagree.
+ *
+ * Retries: NUM_THREADS threads each own one node, and keep pushing it onto
+ * a shared stack and popping one back off (not necessarily the same one.)
+ * Both snapshot the head with each kind of read and swap it with
+ * counted_compare_and_swap(), and count how often that fails.
+ *
+ * Run it on a machine with more cores than threads; on one core there is
+ * little contention to measure.
+ ****************************************************************************/
+
+#define NREADS (2000000L)
+#define NITER (1000000L)
+#define NUM_READERS (3)
+#define NUM_THREADS (4)
+
+struct node {
+	struct node *next;
+} __attribute__((aligned(16)));
+
+static struct counted_ptr word __attribute__((aligned(64)));
+static struct counted_ptr top __attribute__((aligned(64)));
+static struct node nodes[NUM_THREADS] __attribute__((aligned(16)));
+static int use_load, readers_done;
+static long torn, retries;
+
+static struct counted_ptr snapshot(const struct counted_ptr *cp)
+{
+	return use_load ? counted_load(cp) : counted_read(cp);
+}
+
+static void *mover(void *arg)
+{
+	struct counted_ptr c;
+
+	while (!__atomic_load_n(&readers_done, __ATOMIC_ACQUIRE)) {
+		c = counted_load_relaxed(&word);
+		counted_compare_and_swap_relaxed(
+			&word, c,
+			(void *)(((counted_get_ctr(c) + 1) & COUNTED_CTR_MASK) *
+				 16),
+			1);
+	}
+	return NULL;
+}
+
+static void *reader(void *arg)
+{
+	struct counted_ptr c;
+	long i, n = 0;
+
+	for (i = 0; i < NREADS; i++) {
+		c = snapshot(&word);
+		if ((uintptr_t)counted_get_ptr(c) !=
+		    (uintptr_t)counted_get_ctr(c) * 16)
+			n++;
+	}
+	__sync_fetch_and_add(&torn, n);
+	return NULL;
+}
+
+static void *pusher_popper(void *arg)
+{
+	struct node *me = arg;
+	struct counted_ptr old;
+	long i, n = 0;
+
+	for (i = 0; i < NITER; i++) {
+		/* push */
+		for (;;) {
+			old = snapshot(&top);
+			me->next = counted_get_ptr(old);
+			if (counted_compare_and_swap_release(&top, old, me, 1))
+				break;
+			n++;
+		}
+		/* pop, whatever is on top */
+		for (;;) {
+			old = snapshot(&top);
+			if (counted_compare_and_swap_acquire(
+				    &top, old,
+				    ((struct node *)counted_get_ptr(old))->next,
+				    1))
+				break;
+			n++;
+		}
+		/* That may not be the node we pushed, but it is ours now */
+		me = counted_get_ptr(old);
+	}
+	__sync_fetch_and_add(&retries, n);
+	return NULL;
+}
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+	       (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void run(int load)
+{
+	pthread_t mtid, tid[NUM_THREADS];
+	const char *name = load ? "counted_load" : "counted_read";
+	struct timespec start;
+	long i;
+
+	use_load = load;
+	torn = retries = 0;
+
+	/* Tearing */
+	readers_done = 0;
+	counted_set(&word, NULL, 0, false);
+	pthread_create(&mtid, NULL, mover, NULL);
+	for (i = 0; i < NUM_READERS; i++)
+		pthread_create(&tid[i], NULL, reader, NULL);
+	for (i = 0; i < NUM_READERS; i++)
+		pthread_join(tid[i], NULL);
+	__atomic_store_n(&readers_done, 1, __ATOMIC_RELEASE);
+	pthread_join(mtid, NULL);
+
+	printf("%s: %ld torn reads in %ld (%.3f%%)\n", name, torn,
+	       NREADS * NUM_READERS, 100.0 * torn / (NREADS * NUM_READERS));
+	if (load && torn != 0)
+		printf("ERROR: counted_load() was torn\n");
+
+	/* Retries.  Every thread pops before it pushes again, so the
+	 * stack never runs dry.
+	 */
+	counted_set(&top, NULL, 0, false);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_create(&tid[i], NULL, pusher_popper, &nodes[i]);
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_join(tid[i], NULL);
+
+	printf("%s: %.4f retries per operation, %.1f ns per operation\n",
+	       name, (double)retries / (2 * NITER * NUM_THREADS),
+	       elapsed(&start) * 1e9 / (2 * NITER * NUM_THREADS));
+}
+
+int main(int argc, char **argv)
+{
+	run(0);
+	run(1);
+	return 0;
+}
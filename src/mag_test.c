@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "as_magazine.h"
+#include "util.h"
+/*****************************************************************************
+ * Unit tests for magazine caches.  NUM_THREADS threads each set up a cache
+ * on a shared depot in front of a freelist of NOBJS objects.  They
+ * allocate a random number of objects, scribble on them, check nobody
+ * else did, and free them again, NITER times.
+ *
+ * Then one thread holds every object while NUM_THREADS more keep asking
+ * for one, NSTARVED times each, and must get NULL every time rather than
+ * spin.
+ *
+ * At the end every object must be back on the freelist exactly once.
+ ****************************************************************************/
+
+#define NITER (200000L)
+#define NUM_THREADS (4)
+#define NOBJS (1024)
+#define MAX_HELD (100)
+#define NSTARVED (10000)
+
+struct myobj {
+	struct as_entry ase;
+	long owner;
+	long seq;
+};
+
+static struct as_head freelist __attribute__((aligned(16)));
+static struct as_depot depot __attribute__((aligned(64)));
+static struct myobj objs[NOBJS] __attribute__((aligned(16)));
+static long allocated;
+static pthread_barrier_t starved_start;
+
+static void *worker(void *arg)
+{
+	long id = (long)arg;
+	struct as_mag_cache cache;
+	struct myobj *held[MAX_HELD];
+	unsigned int seed = id;
+	long i;
+	int n, j;
+
+	if (!as_mag_cache_init(&cache, &depot)) {
+		printf("ERROR: Could not set up cache\n");
+		return NULL;
+	}
+
+	for (i = 0; i < NITER; i += n) {
+		n = rand_r(&seed) % MAX_HELD + 1;
+		for (j = 0; j < n; j++) {
+			held[j] = (struct myobj *)as_mag_alloc(&cache);
+			if (held[j] == NULL) {
+				printf("ERROR: Ran out of objects\n");
+				n = j;
+				break;
+			}
+			held[j]->owner = id;
+			held[j]->seq = i + j;
+		}
+		__sync_fetch_and_add(&allocated, n);
+		for (j = 0; j < n; j++) {
+			if (held[j]->owner != id || held[j]->seq != i + j)
+				printf("ERROR: Object handed out twice\n");
+			as_mag_free(&cache, &held[j]->ase);
+		}
+	}
+
+	as_mag_cache_release(&cache);
+	return NULL;
+}
+
+/* Allocate from a depot with nothing left */
+static void *starved(void *arg)
+{
+	struct as_mag_cache cache;
+	long i;
+
+	if (!as_mag_cache_init(&cache, &depot)) {
+		printf("ERROR: Could not set up cache\n");
+		return NULL;
+	}
+	pthread_barrier_wait(&starved_start);
+	for (i = 0; i < NSTARVED; i++) {
+		if (as_mag_alloc(&cache) != NULL) {
+			printf("ERROR: Allocated from an empty depot\n");
+			break;
+		}
+	}
+	as_mag_cache_release(&cache);
+	return NULL;
+}
+
+/* Take every object, then let NUM_THREADS threads ask for more */
+static void exhaust(void)
+{
+	static struct as_entry *held[NOBJS];
+	struct as_mag_cache cache;
+	pthread_t tid[NUM_THREADS];
+	long i, n;
+
+	if (!as_mag_cache_init(&cache, &depot)) {
+		printf("ERROR: Could not set up cache\n");
+		return;
+	}
+	for (n = 0; n < NOBJS; n++) {
+		held[n] = as_mag_alloc(&cache);
+		if (held[n] == NULL)
+			break;
+	}
+	if (n != NOBJS || as_mag_alloc(&cache) != NULL)
+		printf("ERROR: Took %ld of %d objects\n", n, NOBJS);
+
+	pthread_barrier_init(&starved_start, NULL, NUM_THREADS);
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_create(&tid[i], NULL, starved, NULL);
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_join(tid[i], NULL);
+	pthread_barrier_destroy(&starved_start);
+
+	while (n > 0)
+		as_mag_free(&cache, held[--n]);
+	as_mag_cache_release(&cache);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t tid[NUM_THREADS];
+	char seen[NOBJS];
+	struct myobj *o;
+	long i, nfree = 0;
+
+	as_init(&freelist);
+	for (i = 0; i < NOBJS; i++)
+		as_push(&freelist, &objs[i].ase);
+	as_depot_init(&depot, &freelist);
+
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_create(&tid[i], NULL, worker, (void *)i);
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_join(tid[i], NULL);
+	exhaust();
+	as_depot_destroy(&depot);
+
+	/* Everything should be back, once */
+	memset(seen, 0, sizeof(seen));
+	while ((o = (struct myobj *)as_pop(&freelist)) != NULL &&
+	       nfree <= NOBJS) {
+		if (o < objs || o >= objs + NOBJS || seen[o - objs]++)
+			printf("ERROR: Bad object %p on the freelist\n", o);
+		nfree++;
+	}
+	if (nfree != NOBJS)
+		printf("ERROR: %d objects, %ld free\n", NOBJS, nfree);
+
+	printf("magazine test: %ld allocations by %d threads\n",
+	       allocated, NUM_THREADS);
+
+	return 0;
+}
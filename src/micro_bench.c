@@ -0,0 +1,126 @@
+#include "bench.h"
+#include "atomic_q.h"
+#include "atomic_stack.h"
+#include "ccas.h"
+#include "util.h"
+/*****************************************************************************
+ * Micro benchmarks for the building blocks, from 1 thread (uncontended)
+ * up to one per CPU.  Each reports ns per operation and throughput, and
+ * where perf_event_open() is allowed, CPU events per operation (see
+ * bench.h for the options and output):
+ *
+ * ccas_private   counted_compare_and_swap() on a counted pointer of the
+ *                thread's own, so never contended
+ * ccas_shared    counted_compare_and_swap() on one counted pointer shared
+ *                by all threads, retried until it succeeds
+ * as_push_pop    as_push() of an entry followed by as_pop() of one, on one
+ *                stack; each is an operation
+ * aq_enq_deq     aq_enqueue() of an element followed by aq_dequeue() of
+ *                one, on one queue; each is an operation
+ ****************************************************************************/
+
+#define MAX_THREADS (256)
+
+struct padded_ptr {
+	struct counted_ptr cp;
+	char _pad[64 - sizeof(struct counted_ptr)];
+} __attribute__((aligned(64)));
+
+static struct padded_ptr private_ptrs[MAX_THREADS];
+static struct padded_ptr shared_ptr;
+static struct as_head stack __attribute__((aligned(64)));
+static struct as_entry *stack_held[MAX_THREADS];
+static struct atomic_q queue __attribute__((aligned(64)));
+
+static void ccas_private(void *arg, int id, long n)
+{
+	struct counted_ptr *cp = &private_ptrs[id].cp;
+	struct counted_ptr old;
+
+	while (n--) {
+		old = counted_load_relaxed(cp);
+		counted_compare_and_swap(cp, old, counted_get_ptr(old), 1);
+	}
+}
+
+static void ccas_shared(void *arg, int id, long n)
+{
+	struct counted_ptr *cp = &shared_ptr.cp;
+	struct counted_ptr old;
+
+	while (n--) {
+		old = counted_load_relaxed(cp);
+		while (!counted_compare_exchange(cp, &old,
+						 counted_get_ptr(old), 1))
+			;
+	}
+}
+
+static void as_push_pop(void *arg, int id, long n)
+{
+	struct as_entry *e = stack_held[id];
+
+	for (; n > 0; n -= 2) {
+		as_push(&stack, e);
+		/* Every thread pops after it pushes, so this never fails */
+		e = as_pop(&stack);
+	}
+	stack_held[id] = e;
+}
+
+static void aq_enq_deq(void *arg, int id, long n)
+{
+	struct atomic_el *el;
+
+	for (; n > 0; n -= 2) {
+		aq_enqueue(&queue, &bench_msg_get()->amsg);
+		el = aq_dequeue(&queue);
+		if (el != NULL)
+			aq_el_free(&queue, el);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_opts o;
+	struct bench_result r;
+	struct bench_msg *dummy;
+	int t, i;
+
+	bench_parse_args(&o, argc, argv);
+	if (o.max_threads > MAX_THREADS)
+		o.max_threads = MAX_THREADS;
+
+	bench_begin(&o);
+	for (t = 1; t <= o.max_threads; t = bench_next_threads(t, &o)) {
+		bench_measure("ccas_private", t, ccas_private, NULL, &o, &r);
+		bench_print(&o, &r);
+
+		bench_measure("ccas_shared", t, ccas_shared, NULL, &o, &r);
+		bench_print(&o, &r);
+
+		as_init(&stack);
+		for (i = 0; i < t; i++) {
+			stack_held[i] = malloc(sizeof(struct as_entry));
+			if (stack_held[i] == NULL)
+				exit(1);
+		}
+		bench_measure("as_push_pop", t, as_push_pop, NULL, &o, &r);
+		bench_print(&o, &r);
+		/* Every thread is done with the stack, and between them they
+		 * hold all the entries
+		 */
+		for (i = 0; i < t; i++)
+			free(stack_held[i]);
+
+		dummy = bench_msg_get();
+		aq_init(&queue, &dummy->amsg, bench_msg_free, NULL);
+		bench_measure("aq_enq_deq", t, aq_enq_deq, NULL, &o, &r);
+		bench_print(&o, &r);
+		aq_free(&queue);
+	}
+	bench_end(&o);
+
+	bench_msg_free_all();
+	return 0;
+}
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "mpsc_q.h"
+#include "util.h"
+/*****************************************************************************
+ * Unit tests for the multi producer/single consumer queue.  NUM_SENDERS
+ * threads each send MSG_PER_SENDER numbered messages, some one at a time
+ * and some as pre-linked chains of CHAIN messages, to a single receiver
+ * (the main thread.)  The receiver checks that every message arrives
+ * exactly once and that each sender's messages arrive in order.
+ ****************************************************************************/
+
+#define NUM_SENDERS (4)
+#define MSG_PER_SENDER (100000L)
+#define CHAIN (8)
+
+struct mymsg {
+	struct atomic_el amsg;
+	long sender;
+	long seq;
+};
+
+static struct mymsg *msgs[NUM_SENDERS];
+
+static void *sender(void *arg)
+{
+	struct mpsc_q *q = (struct mpsc_q *)arg;
+	static long next_sender;
+	long me = __sync_fetch_and_add(&next_sender, 1);
+	struct mymsg *m = msgs[me];
+	long i, j;
+
+	for (i = 0; i < MSG_PER_SENDER; ) {
+		/* Every other round, send a chain */
+		if ((i / CHAIN) % 2 && i + CHAIN <= MSG_PER_SENDER) {
+			for (j = 0; j < CHAIN; j++) {
+				m[i + j].sender = me;
+				m[i + j].seq = i + j;
+				aq_el_chain(&m[i + j].amsg, j + 1 < CHAIN ?
+					    &m[i + j + 1].amsg : NULL);
+			}
+			mpsc_enqueue_multi(q, &m[i].amsg);
+			i += CHAIN;
+		} else {
+			m[i].sender = me;
+			m[i].seq = i;
+			mpsc_enqueue(q, &m[i].amsg);
+			i++;
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t tid[NUM_SENDERS];
+	struct mpsc_q q __attribute__((aligned(64)));
+	long expect[NUM_SENDERS];
+	struct atomic_el *el;
+	struct mymsg *m;
+	long i, received = 0;
+
+	mpsc_init(&q);
+	if (!mpsc_empty(&q) || mpsc_dequeue(&q) != NULL)
+		printf("ERROR: New queue not empty!\n");
+
+	for (i = 0; i < NUM_SENDERS; i++) {
+		msgs[i] = aligned_alloc(16, MSG_PER_SENDER * sizeof(struct mymsg));
+		expect[i] = 0;
+	}
+	for (i = 0; i < NUM_SENDERS; i++)
+		pthread_create(&tid[i], NULL, sender, &q);
+
+	while (received < NUM_SENDERS * MSG_PER_SENDER) {
+		el = mpsc_dequeue(&q);
+		if (el == NULL) {
+			sched_yield();
+			continue;
+		}
+		m = container_of(el, struct mymsg, amsg);
+		if (m->sender < 0 || m->sender >= NUM_SENDERS ||
+		    m->seq != expect[m->sender])
+			printf("ERROR: Got message %ld/%ld out of order\n",
+			       m->sender, m->seq);
+		else
+			expect[m->sender]++;
+		received++;
+	}
+
+	for (i = 0; i < NUM_SENDERS; i++)
+		pthread_join(tid[i], NULL);
+
+	if (!mpsc_empty(&q) || mpsc_dequeue(&q) != NULL)
+		printf("ERROR: Final queue not empty!\n");
+	for (i = 0; i < NUM_SENDERS; i++) {
+		if (expect[i] != MSG_PER_SENDER)
+			printf("ERROR: Sender %ld: got %ld messages\n",
+			       i, expect[i]);
+		free(msgs[i]);
+	}
+
+	printf("mpsc test: exchanged %ld messages\n", received);
+
+	return 0;
+}
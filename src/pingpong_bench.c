@@ -0,0 +1,215 @@
+#include "bench.h"
+#include "atomic_q.h"
+#include "aq_wait.h"
+#include "ccas.h"
+#include "util.h"
+/*****************************************************************************
+ * Round trip latency between two threads.  Thread A enqueues a message on
+ * one queue and waits for the reply on a second.  Thread B waits on the
+ * first and answers on the second, one message at a time.  A times every
+ * round trip into a struct bench_hist.
+ *
+ * Each run picks one way of waiting for the other thread, the aq_waiter
+ * modes of aq_dequeue_spinwait():
+ *
+ *     spin       AQ_WAIT_SPIN, never leave the CPU
+ *     yield      AQ_WAIT_YIELD, sched_yield() until something arrives
+ *     futex      AQ_WAIT_PARK, sleep on the queue's futex right away
+ *     adaptive   AQ_WAIT_ADAPTIVE, spin, then yield, then sleep
+ *
+ * and one placement of the two threads (see enum bench_place):
+ * same_cpu, smt (hyperthreads of one core), same_socket and cross_socket.
+ * Placements this machine doesn't have are left out, as is spinning on
+ * one CPU, where every round trip would wait for a time slice to end.
+ *
+ * The ccas rows are the floor for each placement: the same ping-pong
+ * with no queue, using <bench_ccas_hit>.  That is two cache line transfers
+ * per round trip, the least any queue could do.
+ *
+ * -n is the number of round trips per round, and -t is ignored.
+ ****************************************************************************/
+
+enum pp_wait {
+	PP_SPIN,
+	PP_YIELD,
+	PP_FUTEX,
+	PP_ADAPTIVE,
+	PP_WAITS
+};
+
+static const char *const pp_wait_names[PP_WAITS] = {
+	[PP_SPIN]	= "spin",
+	[PP_YIELD]	= "yield",
+	[PP_FUTEX]	= "futex",
+	[PP_ADAPTIVE]	= "adaptive",
+};
+
+static const enum aq_wait_mode pp_wait_modes[PP_WAITS] = {
+	[PP_SPIN]	= AQ_WAIT_SPIN,
+	[PP_YIELD]	= AQ_WAIT_YIELD,
+	[PP_FUTEX]	= AQ_WAIT_PARK,
+	[PP_ADAPTIVE]	= AQ_WAIT_ADAPTIVE,
+};
+
+struct pp_run {
+	void *(*ping)(void *);
+	void *(*pong)(void *);
+	enum pp_wait wait;
+	int cpu[2];
+	long untimed;		/* round trips before we start timing */
+	long total;		/* all round trips */
+	struct bench_hist hist;
+};
+
+static struct atomic_q request __attribute__((aligned(64)));
+static struct atomic_q reply __attribute__((aligned(64)));
+static pthread_barrier_t start;
+
+static void *aq_ping(void *arg)
+{
+	struct pp_run *r = arg;
+	struct atomic_el *el;
+	struct aq_waiter w;
+	uint64_t t0;
+	long i;
+
+	bench_pin(r->cpu[0]);
+	aq_waiter_init(&w, pp_wait_modes[r->wait]);
+	pthread_barrier_wait(&start);
+	for (i = 0; i < r->total; i++) {
+		t0 = bench_now_ns();
+		aq_enqueue(&request, &bench_msg_get()->amsg);
+		el = aq_dequeue_spinwait(&reply, AQ_BLOCK, &w);
+		if (i >= r->untimed)
+			bench_hist_add(&r->hist, bench_now_ns() - t0);
+		aq_el_free(&reply, el);
+	}
+	return NULL;
+}
+
+static void *aq_pong(void *arg)
+{
+	struct pp_run *r = arg;
+	struct atomic_el *el;
+	struct aq_waiter w;
+	long i;
+
+	bench_pin(r->cpu[1]);
+	aq_waiter_init(&w, pp_wait_modes[r->wait]);
+	pthread_barrier_wait(&start);
+	for (i = 0; i < r->total; i++) {
+		el = aq_dequeue_spinwait(&request, AQ_BLOCK, &w);
+		aq_el_free(&request, el);
+		aq_enqueue(&reply, &bench_msg_get()->amsg);
+	}
+	return NULL;
+}
+
+static void *ccas_ping(void *arg)
+{
+	struct pp_run *r = arg;
+	uint64_t t0;
+	long i;
+
+	bench_pin(r->cpu[0]);
+	pthread_barrier_wait(&start);
+	for (i = 0; i < r->total; i++) {
+		t0 = bench_now_ns();
+		bench_ccas_hit(2 * i);
+		/* Our turn comes back when the counter is even again */
+		bench_ccas_wait(2 * i + 2);
+		if (i >= r->untimed)
+			bench_hist_add(&r->hist, bench_now_ns() - t0);
+	}
+	return NULL;
+}
+
+static void *ccas_pong(void *arg)
+{
+	struct pp_run *r = arg;
+	long i;
+
+	bench_pin(r->cpu[1]);
+	pthread_barrier_wait(&start);
+	for (i = 0; i < r->total; i++)
+		bench_ccas_hit(2 * i + 1);
+	return NULL;
+}
+
+static void run(struct bench_opts *o, struct pp_run *r, const char *name,
+		enum bench_place place)
+{
+	struct bench_row row;
+	struct bench_msg *dummy[2];
+	pthread_t tid[2];
+	int i;
+
+	bench_hist_init(&r->hist);
+	r->untimed = o->ops * o->warmup;
+	r->total = o->ops * (o->warmup + o->reps);
+	for (i = 0; i < 2; i++)
+		dummy[i] = bench_msg_get();
+	aq_init(&request, &dummy[0]->amsg, bench_msg_free, NULL);
+	aq_init(&reply, &dummy[1]->amsg, bench_msg_free, NULL);
+	bench_ccas_reset();
+	pthread_barrier_init(&start, NULL, 2);
+
+	pthread_create(&tid[0], NULL, r->ping, r);
+	pthread_create(&tid[1], NULL, r->pong, r);
+	for (i = 0; i < 2; i++)
+		pthread_join(tid[i], NULL);
+
+	aq_free(&request);
+	aq_free(&reply);
+	pthread_barrier_destroy(&start);
+
+	bench_row_init(&row);
+	bench_row_str(&row, "benchmark", name);
+	bench_row_str(&row, "wait", r->ping == ccas_ping ? "spin" :
+		      pp_wait_names[r->wait]);
+	bench_row_str(&row, "placement", bench_place_names[place]);
+	bench_row_long(&row, "cpu_a", r->cpu[0]);
+	bench_row_long(&row, "cpu_b", r->cpu[1]);
+	bench_row_long(&row, "round_trips", r->hist.count);
+	bench_row_hist(&row, &r->hist);
+	bench_print_row(o, &row);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_opts o;
+	struct pp_run *r;
+	enum bench_place place;
+	enum pp_wait wait;
+
+	bench_parse_args(&o, argc, argv);
+	r = malloc(sizeof(*r));
+	if (r == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	bench_begin(&o);
+	for (place = 0; place < BENCH_PLACES; place++) {
+		if (!bench_find_pair(place, &r->cpu[0], &r->cpu[1]))
+			continue;
+		if (place != BENCH_SAME_CPU) {
+			r->ping = ccas_ping;
+			r->pong = ccas_pong;
+			run(&o, r, "ccas", place);
+		}
+		for (wait = 0; wait < PP_WAITS; wait++) {
+			if (place == BENCH_SAME_CPU && wait == PP_SPIN)
+				continue;
+			r->ping = aq_ping;
+			r->pong = aq_pong;
+			r->wait = wait;
+			run(&o, r, "aq", place);
+		}
+	}
+	bench_end(&o);
+
+	bench_msg_free_all();
+	free(r);
+	return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef __RECLAIM_TEST_H__
+#define __RECLAIM_TEST_H__
+
+#include <stdlib.h>
+#include <string.h>
+#include "atomic_q.h"
+#include "atomic_stack.h"
+#include "util.h"
+
+/*****************************************************************************
+ * What the safe memory reclamation tests (hp_test.c and ebr_test.c) share:
+ * messages and stack entries that come from malloc(), and are overwritten
+ * with garbage and handed back to free() as soon as the queue, stack or
+ * domain lets go of them.  A read of a freed element then sees the garbage,
+ * and should crash or trip an assert.
+ *
+ * Every allocation and free is counted in num_alloc and num_free, which
+ * must match once everything has been torn down.  Queues are set up with
+ * (void *)0xbaddecaf as the freeer argument, and free_msg() checks it.
+ ****************************************************************************/
+
+struct mymsg {
+	struct atomic_el amsg;
+	long payload;
+};
+
+struct myentry {
+	struct as_entry ase;
+	long payload;
+};
+
+static long num_alloc, num_free;
+
+static void *alloc(size_t size)
+{
+	void *p = aligned_alloc(16, size);
+
+	__sync_fetch_and_add(&num_alloc, 1);
+	return p;
+}
+
+/* Poison and free, so use after free shows up */
+static void release(void *p, size_t size)
+{
+	memset(p, 0xA5, size);
+	free(p);
+	__sync_fetch_and_add(&num_free, 1);
+}
+
+static void free_msg(void *arg, struct atomic_el *el)
+{
+	assert((void *)0xbaddecaf == arg);
+	release(container_of(el, struct mymsg, amsg), sizeof(struct mymsg));
+}
+
+static void free_entry(void *arg, void *p)
+{
+	release(p, sizeof(struct myentry));
+}
+
+static struct mymsg *new_msg(long payload)
+{
+	struct mymsg *m = alloc(sizeof(*m));
+
+	aq_el_init(&m->amsg);
+	m->payload = payload;
+	return m;
+}
+
+#endif
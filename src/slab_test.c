@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "aq_slab.h"
+#include "atomic_q.h"
+#include "util.h"
+/*****************************************************************************
+ * Unit tests for the slab allocator.  NUM_SENDERS threads allocate NMSG
+ * messages from a slab and send them to NUM_RECEIVERS threads through a
+ * struct atomic_q that uses the slab's freeer, so each message goes back
+ * to the slab once the queue is done with it.
+ *
+ * The arenas are kept small so the slab grows while the test runs.  At
+ * the end, every object the slab ever carved must be back on its
+ * freelist exactly once.
+ ****************************************************************************/
+
+#define NMSG (200000L)
+#define NUM_SENDERS (4)
+#define NUM_RECEIVERS (4)
+#define ARENA_OBJS (32)
+static const long SHUTDOWN = -1;
+
+/* The element deliberately isn't first */
+struct mymsg {
+	long payload;
+	long sender;
+	struct atomic_el amsg;
+	char data[40];
+};
+
+static struct aq_slab slab;
+static long msgs_sent, msgs_received;
+
+static struct mymsg *new_msg(long payload)
+{
+	struct mymsg *m = aq_slab_alloc(&slab);
+
+	assert(m != NULL);
+	assert(((unsigned long)&m->amsg & 0x0F) == 0);
+	m->payload = payload;
+	memset(m->data, (int)payload, sizeof(m->data));
+	return m;
+}
+
+static void *sender(void *arg)
+{
+	struct atomic_q *mb = (struct atomic_q *)arg;
+
+	while (__sync_fetch_and_add(&msgs_sent, 1) < NMSG)
+		aq_enqueue(mb, &new_msg(1)->amsg);
+	__sync_fetch_and_sub(&msgs_sent, 1);
+	return NULL;
+}
+
+static void *receiver(void *arg)
+{
+	struct atomic_q *mb = (struct atomic_q *)arg;
+	struct atomic_el *el;
+	struct mymsg *m;
+
+	for (;;) {
+		el = aq_dequeue_wait(mb, AQ_BLOCK);
+		m = container_of(el, struct mymsg, amsg);
+		if (m->payload == SHUTDOWN) {
+			aq_el_free(mb, el);
+			return NULL;
+		}
+		if (m->payload != 1 || m->data[sizeof(m->data) - 1] != 1)
+			printf("ERROR: Received corrupt message\n");
+		__sync_fetch_and_add(&msgs_received, 1);
+		aq_el_free(mb, el);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t stid[NUM_SENDERS], rtid[NUM_RECEIVERS];
+	struct atomic_q mb __attribute__((aligned(64)));
+	uint64_t nfree = 0;
+	int i;
+
+	aq_slab_init(&slab, sizeof(struct mymsg),
+		     offsetof(struct mymsg, amsg), ARENA_OBJS);
+	aq_init(&mb, aq_slab_alloc_el(&slab), aq_slab_freeer, &slab);
+
+	for (i = 0; i < NUM_SENDERS; i++)
+		pthread_create(&stid[i], NULL, sender, &mb);
+	for (i = 0; i < NUM_RECEIVERS; i++)
+		pthread_create(&rtid[i], NULL, receiver, &mb);
+	for (i = 0; i < NUM_SENDERS; i++)
+		pthread_join(stid[i], NULL);
+	for (i = 0; i < NUM_RECEIVERS; i++)
+		aq_enqueue(&mb, &new_msg(SHUTDOWN)->amsg);
+	for (i = 0; i < NUM_RECEIVERS; i++)
+		pthread_join(rtid[i], NULL);
+	aq_free(&mb);
+
+	if (msgs_received != NMSG)
+		printf("ERROR: Sent %ld messages, received %ld\n",
+		       msgs_sent, msgs_received);
+
+	/* Everything should be back, once.  A double free would show up
+	 * as too many (or a loop.)
+	 */
+	while (as_pop(&slab.free) != NULL && nfree <= slab.nobjs)
+		nfree++;
+	if (nfree != slab.nobjs || slab.nobjs % ARENA_OBJS)
+		printf("ERROR: Slab has %lu objects, %lu free\n",
+		       (unsigned long)slab.nobjs, (unsigned long)nfree);
+
+	printf("slab test: exchanged %ld messages using %lu objects\n",
+	       msgs_received, (unsigned long)slab.nobjs);
+	aq_slab_destroy(&slab);
+
+	return 0;
+}
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "spsc_q.h"
+#include "util.h"
+/*****************************************************************************
+ * Unit tests for the single producer/single consumer queues.  One thread
+ * sends NMSG numbered messages through a struct spsc_q and then through a
+ * struct spsc_ring, and a second thread checks that every message arrives
+ * exactly once and in order.
+ *
+ * For the intrusive queue the messages come from a small pool of MAX_MSG
+ * elements recycled through the freeer, so elements are reused while the
+ * queue may still hold them as the dummy.
+ ****************************************************************************/
+
+#define NMSG (1000000L)
+#define MAX_MSG (256)
+#define CAPACITY (64)
+
+struct mymsg {
+	struct atomic_el amsg;
+	long payload;
+	long in_use;
+} msgs[MAX_MSG] __attribute__((aligned(16)));
+
+static long num_alloc, num_free;
+
+/* The producer takes messages round robin, waiting for them to come back */
+static struct mymsg *get_msg(void)
+{
+	struct mymsg *m = &msgs[num_alloc++ % MAX_MSG];
+
+	while (__atomic_load_n(&m->in_use, __ATOMIC_ACQUIRE))
+		sched_yield();
+	m->in_use = 1;
+	aq_el_init(&m->amsg);
+	return m;
+}
+
+static void free_msg(void *arg, struct atomic_el *el)
+{
+	struct mymsg *m = container_of(el, struct mymsg, amsg);
+
+	assert((void *)0xbaddecaf == arg);
+	if (!m->in_use)
+		printf("ERROR: Freeing a free message\n");
+	num_free++;
+	__atomic_store_n(&m->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void *q_sender(void *arg)
+{
+	struct spsc_q *q = (struct spsc_q *)arg;
+	struct mymsg *m;
+	long i;
+
+	for (i = 0; i < NMSG; i++) {
+		m = get_msg();
+		m->payload = i;
+		spsc_enqueue(q, &m->amsg);
+	}
+	return NULL;
+}
+
+static void *ring_sender(void *arg)
+{
+	struct spsc_ring *r = (struct spsc_ring *)arg;
+	long i;
+
+	for (i = 0; i < NMSG; i++)
+		while (!spsc_ring_try_enqueue(r, (void *)(i + 1)))
+			sched_yield();
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct spsc_q q __attribute__((aligned(64)));
+	struct spsc_ring *r;
+	struct atomic_el *el;
+	struct mymsg *m;
+	pthread_t tid;
+	void *data;
+	long i;
+
+	/* Intrusive queue */
+	spsc_init(&q, &get_msg()->amsg, free_msg, (void *)0xbaddecaf);
+	pthread_create(&tid, NULL, q_sender, &q);
+	for (i = 0; i < NMSG; i++) {
+		while ((el = spsc_dequeue(&q)) == NULL)
+			sched_yield();
+		m = container_of(el, struct mymsg, amsg);
+		if (m->payload != i)
+			printf("ERROR: Got message %ld, expected %ld\n",
+			       m->payload, i);
+		spsc_el_free(&q, el);
+	}
+	pthread_join(tid, NULL);
+	if (!spsc_empty(&q) || spsc_dequeue(&q) != NULL)
+		printf("ERROR: Final queue not empty!\n");
+	spsc_free(&q);
+	if (num_free != num_alloc)
+		printf("ERROR: Allocated %ld messages, freed %ld\n",
+		       num_alloc, num_free);
+
+	/* Ring */
+	r = aligned_alloc(64, spsc_ring_size(CAPACITY));
+	spsc_ring_init(r, CAPACITY);
+	pthread_create(&tid, NULL, ring_sender, r);
+	for (i = 0; i < NMSG; i++) {
+		while ((data = spsc_ring_try_dequeue(r)) == NULL)
+			sched_yield();
+		if (data != (void *)(i + 1))
+			printf("ERROR: Got ring message %ld, expected %ld\n",
+			       (long)data - 1, i);
+	}
+	pthread_join(tid, NULL);
+	if (spsc_ring_try_dequeue(r) != NULL)
+		printf("ERROR: Final ring not empty!\n");
+	free(r);
+
+	printf("spsc test: exchanged %ld messages\n", 2 * NMSG);
+
+	return 0;
+}
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifndef AQ_STATS
+#define AQ_STATS
+#endif
+#define AQ_STATS_SHARDS (4)
+#include "atomic_q.h"
+#include "util.h"
+/*****************************************************************************
+ * Unit tests for the queue statistics.  NUM_THREADS threads each enqueue
+ * NMSG messages and dequeue as many, on one queue, with more threads than
+ * shards so some shards are shared.  Afterwards the counters must add up:
+ * every message enqueued, dequeued and freed exactly once, one successful
+ * link and one tail swing per enqueue, and one successful head move per
+ * dequeue.  Then a reset must zero them.
+ ****************************************************************************/
+
+#define NMSG (100000L)
+#define NUM_THREADS (8)
+
+struct mymsg {
+	struct atomic_el amsg;
+	long payload;
+} __attribute__((aligned(16)));
+
+static struct atomic_q queue __attribute__((aligned(64)));
+static struct mymsg msgs[NUM_THREADS * NMSG + 1];
+static long nfreed;
+
+static void free_msg(void *arg, struct atomic_el *el)
+{
+	__sync_fetch_and_add(&nfreed, 1);
+}
+
+static void *worker(void *arg)
+{
+	struct mymsg *mine = &msgs[(long)arg * NMSG + 1];
+	struct atomic_el *el;
+	long i;
+
+	for (i = 0; i < NMSG; i++) {
+		aq_el_init(&mine[i].amsg);
+		aq_enqueue(&queue, &mine[i].amsg);
+		/* Others may have taken ours, but there is one for us */
+		while ((el = aq_dequeue(&queue)) == NULL)
+			;
+		aq_el_free(&queue, el);
+	}
+	return NULL;
+}
+
+static void check(struct aq_stats_snapshot *s, enum aq_stat stat, long want)
+{
+	if (s->count[stat] != (uint64_t)want)
+		printf("ERROR: %s is %lu, expected %ld\n", aq_stat_names[stat],
+		       (unsigned long)s->count[stat], want);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t tid[NUM_THREADS];
+	struct aq_stats_snapshot s;
+	const long total = NUM_THREADS * NMSG;
+	long i;
+	int j;
+
+	aq_el_init(&msgs[0].amsg);
+	aq_init(&queue, &msgs[0].amsg, free_msg, NULL);
+
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_create(&tid[i], NULL, worker, (void *)i);
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_join(tid[i], NULL);
+
+	aq_get_stats(&queue, &s);
+	check(&s, AQ_STAT_ENQUEUE, total);
+	check(&s, AQ_STAT_DEQUEUE, total);
+	/* The first dummy is freed, and the last message is the dummy now */
+	check(&s, AQ_STAT_EL_FREE, nfreed);
+	check(&s, AQ_STAT_EL_FREE, total);
+	check(&s, AQ_STAT_ENQ_SWING, total);
+	if (s.count[AQ_STAT_ENQ_LINK] - s.count[AQ_STAT_ENQ_LINK_FAIL] !=
+	    (uint64_t)total)
+		printf("ERROR: Wrong number of successful links\n");
+	if (s.count[AQ_STAT_DEQ_HEAD] - s.count[AQ_STAT_DEQ_HEAD_FAIL] !=
+	    (uint64_t)total)
+		printf("ERROR: Wrong number of successful head moves\n");
+
+	printf("stats test:");
+	for (j = 0; j < AQ_STAT_NR; j++)
+		printf(" %s=%lu", aq_stat_names[j], (unsigned long)s.count[j]);
+	printf("\n");
+
+	aq_reset_stats(&queue);
+	aq_get_stats(&queue, &s);
+	for (j = 0; j < AQ_STAT_NR; j++)
+		check(&s, j, 0);
+
+	aq_free(&queue);
+	return 0;
+}